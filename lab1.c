@@ -15,6 +15,8 @@
 #include <sys/types.h>
 #include <signal.h>
 
+#include "relay.h"
+
 struct termios termios_save;
 int read_pipe_to_term;
 
@@ -36,14 +38,6 @@ void error_and_exit(const char* message, const char* error, const int line)
   exit(1);
 }
 
-void error_and_exit_child(const char* message, const char* error, int parentfd, int line)
-{
-  // We don't reset terminal here since fd 0 has likely been replaced already
-  write(parentfd, "\x4", 1);
-  fprintf(stderr, "ERROR: %s at line %d: %s\xD\xA", message, line, error);
-  exit(1);
-}
-
 int print_exit_status()
 {
   int wstatus = 0;
@@ -57,66 +51,11 @@ int print_exit_status()
 
 void catch_sigpipe()
 {
-  // Read remaining input and then exit
-  struct pollfd shell = {read_pipe_to_term, POLLIN, 0};
-  const int SIZE = 256;
-  char* buf = malloc(SIZE);
-  int errsv = errno;
-  if (buf == NULL)
-    error_and_exit("could not initialize buf: malloc() failed", strerror(errsv), __LINE__);
-  while(1) {
-    int c = poll(&shell, 1, 0);
-    // printf("Return value of poll: %d\xD\xA", c);
-    int errsv = errno;
-    if (c < 0) {
-      error_and_exit("poll() failed", strerror(errsv), __LINE__);
-    }
-    else if (c == 0) // No more input left; perform shutdown sequence
-      goto end;
-    else {
-      //if (shell.revents & POLLIN != 0)
-	
-
-      // Poll succeeded, so read from shell
-      int bytes_read = read(read_pipe_to_term, buf, SIZE);
-      int errsv = errno;
-      if (bytes_read < 0)
-	error_and_exit("could not read from shell: read() failed", strerror(errsv), __LINE__);
-
-      if (bytes_read == 0)
-	goto end;
-
-      // Write buffer
-      for (int i = 0; i < bytes_read; i++) {
-	switch(*(buf+i)) {
-	case 13:
-	  // Receive <CR> from shell, print to stdout unmodified
-	  if (write(1, buf+i, 1) == -1)
-	    error_and_exit("could not write to stdout: write(1) failed", \
-			   strerror(errno), __LINE__);
-	  break;
-
-	case 10:
-	  // Receive <LF> from shell, map to <CR><LF> for stdout
-	  if (write(1, "\xD\xA", 2) == -1)
-	    error_and_exit("could not write to stdout: write(1) failed", \
-			   strerror(errno), __LINE__);
-	  break;
-
-	default:
-	  if (write(1, buf+i, 1) == -1)
-	    error_and_exit("could not write to stdout: write(1) failed", \
-			   strerror(errno), __LINE__);
-	  break;
-	}    
-      }
-    }
-    end: ;
-    reset_terminal();
-    const int SHELL_STATUS = print_exit_status();
-    free(buf);
-    exit(SHELL_STATUS);
-  }
+  // Print remaining output and then exit
+  relay_drain(read_pipe_to_term, 1);
+  reset_terminal();
+  const int SHELL_STATUS = print_exit_status();
+  exit(SHELL_STATUS);
 }
 
 int execute_without_shell()
@@ -157,282 +96,93 @@ int execute_without_shell()
 
 int execute_with_shell()
 {
-  // Implement pipes
   int pipefd_to_bash[2], pipefd_to_term[2];
-  if (pipe(pipefd_to_bash) == -1) {
-    error_and_exit("unable to initialize pipefd_to_bash: pipe() failed", strerror(errno), __LINE__);
-  }
-  if (pipe(pipefd_to_term) == -1) {
-    error_and_exit("unable to initialize pipefd_to_term: pipe() failed", strerror(errno), __LINE__);
-  }
-
-  read_pipe_to_term = pipefd_to_term[1];
-
-  // Fork process
-  pid_t pid = fork();
-  int errsv = errno;
-  if (pid == -1) {
-    error_and_exit("fork() failed", strerror(errsv), __LINE__);
-  }
+  pid_t pid = relay_start_shell(pipefd_to_bash, pipefd_to_term);
+  read_pipe_to_term = pipefd_to_term[0];
   
   // Implement signal handler for SIGPIPE
   signal(SIGPIPE, catch_sigpipe);
-  // kill(getpid(), SIGPIPE);
 
-  if (pid == 0) {
-    // Replace stdin with pipe from terminal process
-    if (close(0) == -1) {
-      write(pipefd_to_term[1], "\x4", 1); // This is redundant
-      error_and_exit("could not close stdin: close(0) failed", strerror(errno), __LINE__);
-    }
-    if (dup2(pipefd_to_bash[0], 0) == -1) {
-      write(pipefd_to_term[1], "\x4", 1); // This is redundant
-      fprintf(stderr, "ERROR: could not duplicate pipefd_to_bash[0]: dup2(%d,%d) "
-	      "failed at line %d: %s\xD\xA", pipefd_to_bash[0], 0, __LINE__, strerror(errno));
-      exit(1);
-    }
-    if (close(pipefd_to_bash[0]) == -1) {
-      write(pipefd_to_term[1], "\x4", 1); // This is redundant
-      fprintf(stderr, "ERROR: could not close pipefd_to_bash[0]: close(%d) "
-	      "failed at line %d: %s\xD\xA", pipefd_to_bash[0], __LINE__, strerror(errno));      
-      exit(1);
-    }
-    if (close(pipefd_to_bash[1]) == -1) {
-      // Note: switching fprintf and write causes terminal not to output properly?
-      fprintf(stderr, "ERROR: could not close pipefd_to_bash[1]: close(%d) "
-	      "failed at line %d: %s\xD\xA", pipefd_to_bash[1], __LINE__, strerror(errno));
-      write(pipefd_to_term[1], "\x4", 1); // This is redundant
-      exit(1);
-    }
-
-    // Replace stdout and stderror with pipe to terminal process
-    if (close(1) == -1) {
-      error_and_exit_child("could not close stdout: "
-			   "close(1) failed", strerror(errno), pipefd_to_term[1], __LINE__);
-    }
+  struct pollfd fds[2];
     
-    if (dup2(pipefd_to_term[1], 1) == -1) {
-      int errsv = errno;
-      char *msg = malloc(0); // Also can do this with char[]
-      free(msg);
-      sprintf(msg, "could not duplicate pipefd_to_term[1]: dup2(%d,1) failed", pipefd_to_term[1]);
-      error_and_exit_child(msg, strerror(errsv), pipefd_to_term[1], __LINE__);
-    }
-
-    // Save stderr before closing
-    int d = dup(2);
-    int errsv = errno;
-    if (d == -1) {
-      error_and_exit_child("could not duplicate stderr: "
-			   "dup(2) failed", strerror(errsv), pipefd_to_term[1], __LINE__);
-    }
+  // Set keyboard poll
+  fds[0].fd = 0;
+  fds[0].events = POLLIN;
     
-    if (close(2) == -1) {
-      error_and_exit_child("could not close stderr: "
-			   "close(2) failed", strerror(errno), pipefd_to_term[1], __LINE__);
-    }
+  // Set bash poll
+  fds[1].fd = pipefd_to_term[0];
+  fds[1].events = POLLIN;
 
-    if(dup2(pipefd_to_term[1], 2) == -1) {
-      int errsv = errno;
-      dup2(d,2); // Restore stderr so that we can print error message
-      char *msg = malloc(0);
-      free(msg);
-      sprintf(msg, "could not duplicate pipefd_to_term[1]: dup2(%d,2) failed", pipefd_to_term[1]);
-      error_and_exit_child(msg, strerror(errsv), pipefd_to_term[1], __LINE__);
-    }
-    
-    if(close(pipefd_to_term[0]) == -1) {
-      int errsv = errno;
-      dup2(d,2);
-      char *msg = malloc(0);
-      free(msg);
-      sprintf(msg, "could not close pipefd_to_term[0]: close(%d) failed", pipefd_to_term[0]);
-      error_and_exit_child(msg, strerror(errsv), pipefd_to_term[1], __LINE__);
-    }
-    
-    if(close(pipefd_to_term[1]) == -1) {
-      int errsv = errno;
-      dup2(d,2);
-      char *msg = malloc(0);
-      free(msg);
-      sprintf(msg, "could not close pipefd_to_term[1]: close(%d) failed", pipefd_to_term[1]);
-      error_and_exit_child(msg, strerror(errsv), 2, __LINE__); // Why only work properly w/ fd 1?
-    }
-    
-    // Exec shell
-    const char* path = "/bin/bash";
-    if (execl(path, path, (char*)NULL) == -1)
-      error_and_exit_child("exec(\"/bin/bash\") failed", strerror(errno), pipefd_to_term[1], __LINE__);
-    exit(1);
-  }
-  else {
-    // Set up poll
-    if (close(pipefd_to_bash[0]) == -1) {
-      int errsv = errno;
-      char *msg = malloc(0);
-      free(msg);
-      sprintf(msg, "could not close pipefd_to_bash[0]: close(%d) failed", pipefd_to_bash[0]);
-      error_and_exit(msg, strerror(errsv), __LINE__);
-    }
-    if (close(pipefd_to_term[1]) == -1) {
-      int errsv = errno;
-      char *msg = malloc(0); free(msg);
-      sprintf(msg, "could not close pipefd_to_term[1]: close(%d) failed", pipefd_to_term[1]);
-      error_and_exit(msg, strerror(errsv), __LINE__);
-    }
-    struct pollfd fds[2];
-    
-    // Set keyboard poll
-    fds[0].fd = 0;
-    fds[0].events = POLLIN;
-    
-    // Set bash poll
-    fds[1].fd = pipefd_to_term[0];
-    fds[1].events = POLLIN;
+  // Read input; translated output can be twice as long
+  const int SIZE = 256;
+  char buf[SIZE], out[2*SIZE], echo[2*SIZE];
 
-    // Read input
-    const int SIZE = 256;
-    char* buf = malloc(SIZE);
+  while(1) {
+    int c = poll(fds,2,0);
     int errsv = errno;
-    if (buf == NULL)
-      error_and_exit("could not initialize buf: malloc() failed", strerror(errsv), __LINE__);
-
-    while(1) {
-      int c = poll(fds,2,0);
+    if (c < 0) {
+      error_and_exit("poll() failed", strerror(errsv), __LINE__);
+    }
+    else if (c > 0) {
+      // Check which poll succeeded
+      int bytes_read;
+      if (fds[0].revents != 0)
+	bytes_read = read(0, buf, SIZE);
+      else
+	bytes_read = read(pipefd_to_term[0], buf, SIZE);
       int errsv = errno;
-      if (c < 0) {
-	error_and_exit("poll() failed", strerror(errsv), __LINE__);
-      }
-      else if (c > 0) {
-	// Check which poll succeeded
-	int bytes_read;
+      if (bytes_read < 0) {
 	if (fds[0].revents != 0)
-	  bytes_read = read(0, buf, SIZE);
-	else if (fds[1].revents != 0)
-	  bytes_read = read(pipefd_to_term[0], buf, SIZE);
-	else { // This should never occur
-	  fprintf(stderr, "Error in poll: no ready file descriptor found.\n");
-	}
-	int errsv = errno;
-	if (bytes_read < 0) {
-	  if (fds[0].revents != 0)
-	    error_and_exit("could not read from stdin: read() failed", strerror(errsv), __LINE__);
-	  else
-	    error_and_exit("could not read from pipefd_to_term[0]: "
-			   "read() failed", strerror(errsv), __LINE__);
-	}
+	  error_and_exit("could not read from stdin: read() failed", strerror(errsv), __LINE__);
+	else
+	  error_and_exit("could not read from pipefd_to_term[0]: "
+			 "read() failed", strerror(errsv), __LINE__);
+      }
 	
-	// Check for EOF; this should never happen for the keyboard
-	if (bytes_read == 0) {
-	  if (fds[0].revents != 0) // This should never occur
-	    fprintf(stderr, "Error!! read(0) indicates return value of zero.\n");
-	  //	  fprintf(stderr, "read() on shell returned 0\xD\xA");
-	  goto end;
-	}
-
-	// Write buffer
-	for (int i = 0; i < bytes_read; i++) {
-	  switch(*(buf+i)) {
-	  case 3:
-	    if (kill(pid, SIGINT) == -1) {
-	      int errsv = errno;
-	      char* msg = malloc(0); free(msg);
-	      sprintf(msg, "sending SIGINT to process %d: kill() failed", pid);
-	      error_and_exit(msg, strerror(errsv), __LINE__);
-	    }
-	    break;
-	  case 4:
-	    // Close pipe to shell
-	    if (close(pipefd_to_bash[1]) == -1) {
-	      int errsv = errno;
-	      char* msg = malloc(0); free(msg);
-	      sprintf(msg, "could not close pipefd_to_bash[1]: close(%d) failed", pipefd_to_bash[1]);
-	      error_and_exit(msg, strerror(errsv), __LINE__);
-	    }
-	    break;
-
-	  case 13:
-	    // Receive <CR> from keyboard, map to <CR><LF> for stdout, <LF> for bash
-	    if (fds[0].revents != 0) {
-	      if (write(1, "\xD\xA", 2) == -1) {
-		error_and_exit("could not write to stdout: write(1) failed", \
-			       strerror(errno), __LINE__);
-	      }
-	      if (write(pipefd_to_bash[1], "\xA", 1) == -1) {
-		int errsv = errno;
-		char* msg = malloc(0); free(msg);
-		sprintf(msg, "could not write to pipefd_to_bash[1]: "
-			"write(%d) failed", pipefd_to_bash[1]);
-		error_and_exit(msg, strerror(errsv), __LINE__);
-	      }
-	    }
-	    // Receive <CR> from shell, write to stdout unmodified
-	    else if (fds[1].revents != 0) {
-	      if (write(1, buf+i, 1) == -1)
-		error_and_exit("could not write to stdout: write(1) failed", \
-			       strerror(errno), __LINE__);
-	    }
-	    break;
+      // Check for EOF; this should never happen for the keyboard
+      if (bytes_read == 0) {
+	if (fds[0].revents != 0) // This should never occur
+	  fprintf(stderr, "Error!! read(0) indicates return value of zero.\n");
+	goto end;
+      }
 
-	  case 10:
-	    // Receive <LF> from keyboard, map to <CR><LF> for stdout, <LF> for bash
-	    if (fds[0].revents != 0) {
-	      if (write(1, "\xD\xA", 2) == -1) {
-		error_and_exit("could not write to stdout: write(1) failed", \
-			       strerror(errno), __LINE__);
-	      }
-	      if (write(pipefd_to_bash[1], buf+i, 1) == -1) {
-		int errsv = errno;
-		char* msg = malloc(0); free(msg);
-		sprintf(msg, "could not write to pipefd_to_bash[1]: "
-			"write(%d) failed", pipefd_to_bash[1]);
-		error_and_exit(msg, strerror(errsv), __LINE__);
-	      }
-	    }
-	    // Receive <LF> from shell, map to <CR><LF> for stdout
-	    else {
-	      if (write(1, "\xD\xA", 2) == -1)
-		error_and_exit("could not write to stdout: write(1) failed", \
-			       strerror(errno), __LINE__);
-	    }
-	    break;
+      // Receive output from shell, map <LF> to <CR><LF> for stdout
+      if (fds[0].revents == 0) {
+	relay_write(1, out, relay_to_term(buf, bytes_read, out, false));
+	continue;
+      }
 
-	  default:
-	    if (write(1, buf+i, 1) == -1)
-	      error_and_exit("could not write to stdout: write(1) failed", \
-			     strerror(errno), __LINE__);
-	    if (fds[0].revents != 0)
-	      if (write(pipefd_to_bash[1], buf+i, 1) == -1) {
-		int errsv = errno;
-		char *msg = malloc(0); free(msg);
-		sprintf(msg, "could not write to pipefd_to_bash[1]: "
-			"write(%d) failed", pipefd_to_bash[1]);
-		error_and_exit(msg, strerror(errsv), __LINE__);
-	      }
-	    break;
-	  }    
+      // Echo keyboard input and pass it on to the shell up to each ^C or ^D
+      for (int i = 0; i < bytes_read; ) {
+	int n = relay_to_shell(buf + i, bytes_read - i, out);
+	relay_write(1, echo, relay_to_term(buf + i, n, echo, true));
+	relay_write(pipefd_to_bash[1], out, n);
+	i += n;
+	if (i == bytes_read)
+	  break;
+	if (buf[i] == RELAY_INTR && kill(pid, SIGINT) == -1) {
+	  int errsv = errno;
+	  char msg[200];
+	  sprintf(msg, "sending SIGINT to process %d: kill() failed", pid);
+	  error_and_exit(msg, strerror(errsv), __LINE__);
 	}
+	else if (buf[i] == RELAY_EOF && close(pipefd_to_bash[1]) == -1) {
+	  int errsv = errno;
+	  char msg[200];
+	  sprintf(msg, "could not close pipefd_to_bash[1]: close(%d) failed", pipefd_to_bash[1]);
+	  error_and_exit(msg, strerror(errsv), __LINE__);
+	}
+	i++;
       }
-      // Reset revents
-      fds[0].revents = 0;
-      fds[1].revents = 0;
     }
-    // In theory, the program would never reach this section
-    printf("Program never reaches here\xD\xA");
-    wait(NULL);
-
-  end: ;
-    /*    int wstatus;    
-    if (wait(&wstatus) == -1)
-      error_and_exit("wait() failed", strerror(errno), __LINE__);
-    const int SHELL_SIGNAL = wstatus & 0x007f;
-    const int SHELL_STATUS = (wstatus & 0xff00)>>8;
-    fprintf(stderr, "SHELL EXIT SIGNAL=%d STATUS=%d\xD\xA", SHELL_SIGNAL, SHELL_STATUS);
-    */
-    const int SHELL_STATUS = print_exit_status();
-    free(buf);
-    return SHELL_STATUS;
+    // Reset revents
+    fds[0].revents = 0;
+    fds[1].revents = 0;
   }
+
+ end: ;
+  const int SHELL_STATUS = print_exit_status();
+  return SHELL_STATUS;
 }
 
 int main(int argc, char* argv[])
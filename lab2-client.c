@@ -1,4 +1,4 @@
-#define _POSIX_SOURCE
+#define _POSIX_C_SOURCE 200112L
 #include <termios.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,6 +7,7 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <signal.h>
@@ -14,6 +15,8 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <sys/un.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -22,7 +25,7 @@
 
 struct termios termios_save;
 int server_fd, logfile_fd;
-bool debug;
+bool debug, mux, priority;
 
 void reset_terminal()
 {
@@ -45,7 +48,8 @@ void error_and_exit2(const char* message, const char* error, const int line, boo
 
 void error_and_exit(const char* message, const char* error, const int line)
 {
-  error_and_exit2(message, error, line, true);
+  // The terminal is left alone in --mux mode
+  error_and_exit2(message, error, line, mux == false);
 }
 
 void logfile_error(char* error, int line)
@@ -54,129 +58,130 @@ void logfile_error(char* error, int line)
 }
 
 #define CHUNK 16384
-int def(char *src, char *dest, const int SIZE, int level)
+#define FRAME_SIZE 4096    // largest uncompressed frame either end deflates
+#define FRAME_HEADER 2     // 16-bit length in front of each frame
+#define FRAME_CONTROL 0x8000  // header bit marking a control frame
+#define POOL_BUFFERS 8
+
+// Control frame codes (--priority); see lab2-server.c
+enum {
+  FRAME_INTR = 1,
+  FRAME_EOF,
+  FRAME_FLUSH
+};
+
+/*
+ * Length-tracked buffers for the compression path.  Every buffer comes out of
+ * one arena allocated at startup and is big enough for a deflated FRAME_SIZE
+ * frame plus its header, so relaying never allocates or truncates a buffer.
+ */
+struct buffer {
+  char* data;
+  int len;
+  int size;
+};
+
+struct buffer_pool {
+  char* arena;
+  struct buffer buffers[POOL_BUFFERS];
+  struct buffer* free[POOL_BUFFERS];
+  int nfree;
+};
+
+struct buffer_pool pool;
+
+void pool_init()
 {
-  if (debug == true)
-    fprintf(stderr, "Starting deflate function (line %d)\xD\xA", __LINE__);
-  
-  int ret, flush;
-  unsigned have;
-  unsigned i = 0;
+  // Size buffers from deflateBound(), plus room for the sync flush marker
   z_stream strm;
-  //unsigned char in[CHUNK];
-  unsigned char out[CHUNK];
-
-  if (debug == true)
-    fprintf(stderr, "Finished declaring variables (line %d)\xD\xA", __LINE__);
-  
-  /* allocate deflate state */
   strm.zalloc = Z_NULL;
   strm.zfree = Z_NULL;
   strm.opaque = Z_NULL;
-  if (debug == true)
-    fprintf(stderr, "Before calling deflateInit() (line %d)\xD\xA", __LINE__);
-  ret = deflateInit(&strm, level);
-  if (debug == true)
-    fprintf(stderr, "Finished calling deflateInit() (line %d)\xD\xA", __LINE__);
-  if (ret != Z_OK)
-    return ret;
-  
-  if (debug == true) {
-    fprintf(stderr, "Finished allocating deflate state (line %d)\xD\xA", __LINE__);
-    fprintf(stderr, "Byte size is: %d\xD\xA", SIZE);
-  }
-
-  strm.avail_in = SIZE;
-  flush = Z_SYNC_FLUSH;
-  strm.next_in = (Bytef*)src;
-  do {
-    strm.avail_out = CHUNK;
-    strm.next_out = out;
-    ret = deflate(&strm, flush);
-    have = CHUNK - strm.avail_out;
-    // Save to dest buffer
-    strncpy(dest+i,(char*)out,have);
-    i += have;
-  } while (strm.avail_out == 0);
-  // Insert null byte
-  *(dest+i) = '\0';
-  if (debug == true)
-    fprintf(stderr, "Finished deflate() (line %d)\xD\xA", __LINE__);
+  if (deflateInit(&strm, Z_DEFAULT_COMPRESSION) != Z_OK)
+    error_and_exit("could not size buffers", "deflateInit() failed", __LINE__);
+  int size = deflateBound(&strm, FRAME_SIZE) + 6;
   (void)deflateEnd(&strm);
-  if (debug == true) {
-    fprintf(stderr, "Finished compressing input (line %d)\xD\xA", __LINE__);
-    fprintf(stderr, "Output buffer: %s\xD\xA", dest);
-    fprintf(stderr, "Length of output buffer is: %d\xD\xA", (int)strlen(dest));
-    fprintf(stderr, "Total bytes is: %d\xD\xA", i);
+  if (size < FRAME_SIZE)
+    size = FRAME_SIZE;
+  size += FRAME_HEADER;
+
+  pool.arena = malloc((size_t)size * POOL_BUFFERS);
+  if (pool.arena == NULL)
+    error_and_exit("could not allocate buffers: malloc() failed", strerror(errno), __LINE__);
+  for (int i = 0; i < POOL_BUFFERS; i++) {
+    pool.buffers[i].data = pool.arena + (size_t)size * i;
+    pool.buffers[i].size = size;
+    pool.free[i] = pool.buffers + i;
   }
-  return i;
+  pool.nfree = POOL_BUFFERS;
 }
 
-#define CHUNK 16384
-int inf(char* src, char* dest, const int SIZE)
+struct buffer* pool_get()
 {
-  int ret;
-  unsigned have;
-  unsigned i = 0;
-  z_stream strm;
-  unsigned char out[CHUNK];
+  if (pool.nfree == 0)
+    error_and_exit("could not get buffer", "buffer pool exhausted", __LINE__);
+  struct buffer* b = pool.free[--pool.nfree];
+  b->len = 0;
+  return b;
+}
 
-  /* allocate inflate state */
-  strm.zalloc = Z_NULL;
-  strm.zfree = Z_NULL;
-  strm.opaque = Z_NULL;
-  strm.avail_in = 0;
-  strm.next_in = Z_NULL;
-  ret = inflateInit(&strm);
-  if (ret != Z_OK)
-    return ret;
-  if (debug == true)
-    fprintf(stderr, "Finished inflateInit() (line %d)\xD\xA", __LINE__);
-  strm.avail_in = SIZE;
-  strm.next_in = (Bytef*)src;
-  do {
-    strm.avail_out = CHUNK;
-    strm.next_out = out;
-    ret = inflate(&strm, Z_SYNC_FLUSH);
+void pool_put(struct buffer* b)
+{
+  pool.free[pool.nfree++] = b;
+}
 
-    if (debug == true)
-      fprintf(stderr, "Value of ret is: %d\xD\xA", ret);
-    /*
-    switch(ret) {
-    case Z_NEED_DICT:
-      ret = Z_DATA_ERROR;
-    case Z_DATA_ERROR:
-    case Z_MEM_ERROR:
-      (void)inflateEnd(&strm);
+/*
+ * Each frame is compressed on its own, but the zlib state is not: every
+ * thread keeps one stream per direction, set up on first use and reset for
+ * each frame, so zlib allocates its window and tables once instead of per
+ * frame.
+ */
+static __thread z_stream inf_strm, def_strm;
+static __thread bool inf_ready, def_ready;
+static __thread int def_level;
+
+// Inflate SIZE bytes of src, appending the result to dest
+int inf(const char* src, const int SIZE, struct buffer* dest)
+{
+  int ret;
+  z_stream* strm = &inf_strm;
+
+  if (inf_ready == false) {
+    /* allocate inflate state */
+    strm->zalloc = Z_NULL;
+    strm->zfree = Z_NULL;
+    strm->opaque = Z_NULL;
+    strm->avail_in = 0;
+    strm->next_in = Z_NULL;
+    ret = inflateInit(strm);
+    if (ret != Z_OK)
       return ret;
-    }
-    */
+    inf_ready = true;
     if (debug == true)
-      fprintf(stderr, "Value of ret is: %d\xD\xA", ret);
+      fprintf(stderr, "Finished inflateInit() (line %d)\xD\xA", __LINE__);
+  }
+  else if ((ret = inflateReset(strm)) != Z_OK)
+    return ret;
 
-    have = CHUNK - strm.avail_out;
-    // Write out to dest
-    strncpy(dest+i, (char*)out, have);
-    i += have;
-  } while (strm.avail_out == 0);
+  strm->avail_in = SIZE;
+  strm->next_in = (Bytef*)src;
+  strm->avail_out = dest->size - dest->len;
+  strm->next_out = (Bytef*)(dest->data + dest->len);
+  ret = inflate(strm, Z_SYNC_FLUSH);
+  if (ret == Z_NEED_DICT)
+    ret = Z_DATA_ERROR;
+  // Input left over means the frame is bigger than any sender produces
+  if (ret == Z_OK && strm->avail_in != 0)
+    ret = Z_BUF_ERROR;
+  dest->len = dest->size - strm->avail_out;
 
-  // Set null byte
-  *(dest+i) = '\0';
-  
   if (debug == true) {
     fprintf(stderr, "Finished inflate() (line %d)\xD\xA", __LINE__);
-    fprintf(stderr, "Input buffer: %s\xD\xA", src);
-    fprintf(stderr, "Output buffer: %s\xD\xA", dest);
-    fprintf(stderr, "Length of output buffer: %d\xD\xA", (int)strlen(dest));
-    fprintf(stderr, "Value of i is: %d\xD\xA", i);
+    fprintf(stderr, "Value of ret is: %d\xD\xA", ret);
+    fprintf(stderr, "Length of output buffer: %d\xD\xA", dest->len);
   }
 
-  (void)inflateEnd(&strm);
-  if (debug == true)
-    fprintf(stderr, "Finished inflateEnd() (line %d)\xD\xA", __LINE__);
-  if (debug == true)
-    fprintf(stderr, "Returning from inf() now (line %d)\xD\xA", __LINE__);
-  return Z_OK;
+  return ret == Z_OK || ret == Z_STREAM_END ? Z_OK : ret;
 }
 
 /* report a zlib or i/o error */
@@ -199,34 +204,286 @@ void zerr(int ret)
   case Z_MEM_ERROR:
     fputs("out of memory\n", stderr);
     break;
+  case Z_BUF_ERROR:
+    fputs("frame larger than buffer\n", stderr);
+    break;
   case Z_VERSION_ERROR:
     fputs("zlib version mismatch!\n", stderr);
   }
 }
 
-void compress_input_and_write(char* compress_in, char* compress_out, const int bytes_read, bool log)
+// Deflate SIZE bytes of src, appending the result to dest
+int def(const char* src, const int SIZE, struct buffer* dest, int level)
 {
   if (debug == true)
-    fprintf(stderr, "Compressing input (line %d)\xD\xA", __LINE__);
-  int compress_size = def(compress_in, compress_out, bytes_read, Z_DEFAULT_COMPRESSION);
-  compress_size = 4; 
-  //compress_size = (int)strlen(compress_out);
+    fprintf(stderr, "Starting deflate function (line %d)\xD\xA", __LINE__);
+
+  int ret;
+  z_stream* strm = &def_strm;
+
+  // A new level needs a new stream
+  if (def_ready == true && level != def_level) {
+    (void)deflateEnd(strm);
+    def_ready = false;
+  }
+  if (def_ready == false) {
+    /* allocate deflate state */
+    strm->zalloc = Z_NULL;
+    strm->zfree = Z_NULL;
+    strm->opaque = Z_NULL;
+    ret = deflateInit(strm, level);
+    if (ret != Z_OK)
+      return ret;
+    def_ready = true;
+    def_level = level;
+  }
+  else if ((ret = deflateReset(strm)) != Z_OK)
+    return ret;
+
+  strm->avail_in = SIZE;
+  strm->next_in = (Bytef*)src;
+  strm->avail_out = dest->size - dest->len;
+  strm->next_out = (Bytef*)(dest->data + dest->len);
+  ret = deflate(strm, Z_SYNC_FLUSH);
+  // Buffers are sized from deflateBound(), so a single call always fits
+  if (ret == Z_OK && (strm->avail_in != 0 || strm->avail_out == 0))
+    ret = Z_BUF_ERROR;
+  dest->len = dest->size - strm->avail_out;
 
   if (debug == true) {
-    fprintf(stderr, "Uncompressed input: %s\xD\xA", compress_in);
-    fprintf(stderr, "Compressed buffer: %s\xD\xA", compress_out);
-    fprintf(stderr, "Length of compressed buffer: %d\xD\xA", compress_size);
-    fprintf(stderr, "Contents of buffer: ");
-    write(2, compress_out, 100);
-    fprintf(stderr, "\xD\xA");
+    fprintf(stderr, "Finished compressing input (line %d)\xD\xA", __LINE__);
+    fprintf(stderr, "Input bytes: %d, total bytes: %d\xD\xA", SIZE, dest->len);
   }
+  return ret;
+}
+
+void write_all(int fd, const char* buf, int len)
+{
+  while (len > 0) {
+    int n = write(fd, buf, len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1)
+      error_and_exit("could not write to socket: write() failed", strerror(errno), __LINE__);
+    buf += n;
+    len -= n;
+  }
+}
+
+// Read exactly len bytes; returns 0 on EOF before the first byte
+int read_all(int fd, char* buf, int len)
+{
+  int total = 0;
+  while (total < len) {
+    int n = read(fd, buf + total, len - total);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1)
+      error_and_exit("could not read from socket: read() failed", strerror(errno), __LINE__);
+    if (n == 0 && total == 0)
+      return 0;
+    if (n == 0)
+      error_and_exit("could not read from socket", "connection closed mid-frame", __LINE__);
+    total += n;
+  }
+  return total;
+}
+
+// Pack src into frame as <length><payload>, deflated if compress is set
+void build_frame(const char* src, const int SIZE, struct buffer* frame, bool compress)
+{
+  frame->len = FRAME_HEADER;
+  if (compress == true) {
+    int ret = def(src, SIZE, frame, Z_DEFAULT_COMPRESSION);
+    if (ret != Z_OK) {
+      zerr(ret);
+      exit(1);
+    }
+  }
+  else {
+    memcpy(frame->data + FRAME_HEADER, src, SIZE);
+    frame->len += SIZE;
+  }
+  int payload = frame->len - FRAME_HEADER;
+  frame->data[0] = (payload >> 8) & 0xff;
+  frame->data[1] = payload & 0xff;
+}
+
+// Read one frame's payload; returns its length, 0 on EOF.  For a control
+// frame the code goes in *control and FRAME_HEADER is returned.
+int read_frame(int fd, struct buffer* frame, int* control)
+{
+  char header[FRAME_HEADER];
+  if (read_all(fd, header, FRAME_HEADER) == 0)
+    return 0;
+  frame->len = ((header[0] & 0xff) << 8) | (header[1] & 0xff);
+  *control = 0;
+  if (frame->len & FRAME_CONTROL) {
+    *control = frame->len & ~FRAME_CONTROL;
+    frame->len = 0;
+    return FRAME_HEADER;
+  }
+  if (frame->len == 0 || frame->len > frame->size)
+    error_and_exit("invalid frame from server", "bad frame length", __LINE__);
+  read_all(fd, frame->data, frame->len);
+  return frame->len;
+}
+
+void compress_input_and_write(struct buffer* raw, struct buffer* frame, bool log)
+{
+  if (debug == true)
+    fprintf(stderr, "Compressing input (line %d)\xD\xA", __LINE__);
+  build_frame(raw->data, raw->len, frame, true);
+
   // Write compressed input out to server and log
-  if (write(server_fd, compress_out, compress_size) == -1)
-    error_and_exit("could not write to server: write() failed", strerror(errno), __LINE__);
-  if (log == true && write(logfile_fd, compress_out, compress_size) == -1)
+  write_all(server_fd, frame->data, frame->len);
+  if (log == true && write(logfile_fd, frame->data, frame->len) == -1)
+    logfile_error(strerror(errno), __LINE__);
+}
+
+void write_control(int code, bool log)
+{
+  char header[FRAME_HEADER] = {((FRAME_CONTROL | code) >> 8) & 0xff, code & 0xff};
+  write_all(server_fd, header, FRAME_HEADER);
+  if (log == true && write(logfile_fd, header, FRAME_HEADER) == -1)
     logfile_error(strerror(errno), __LINE__);
 }
 
+// With --priority, ^C goes out first as a control frame, ahead of anything
+// else typed in the same read; ^D keeps its place in the stream.  Returns
+// true if an interrupt was sent.
+bool send_keyboard_frames(struct buffer* raw, struct buffer* frame, bool log, bool compress)
+{
+  bool interrupted = false;
+  int len = 0;
+  for (int i = 0; i < raw->len; i++) {
+    if (raw->data[i] == 3)
+      interrupted = true;
+    else
+      raw->data[len++] = raw->data[i];
+  }
+  if (interrupted == true)
+    write_control(FRAME_INTR, log);
+
+  int start = 0;
+  for (int i = 0; i <= len; i++) {
+    if (i < len && raw->data[i] != 4)
+      continue;
+    if (i > start) {
+      build_frame(raw->data + start, i - start, frame, compress);
+      write_all(server_fd, frame->data, frame->len);
+      if (log == true && write(logfile_fd, frame->data, frame->len) == -1)
+	logfile_error(strerror(errno), __LINE__);
+    }
+    if (i < len)
+      write_control(FRAME_EOF, log);
+    start = i + 1;
+  }
+  return interrupted;
+}
+
+/*
+ * Predictive local echo (--predict[=MS])
+ *
+ * With the server's --echo, keystrokes reach the terminal only after the
+ * round trip.  Every key sent is queued together with the bytes its echo is
+ * expected to produce; printable keys are also shown right away as
+ * predictions.  Matching echo bytes confirm the queue head (and are not shown
+ * a second time), and any other output first erases the unconfirmed
+ * predictions and drops the queue.  Confirmations feed a smoothed RTT, and
+ * predictions are only shown while it is at least MS milliseconds.
+ */
+#define PREDICT_MAX 256
+
+struct prediction {
+  char c;
+  bool shown;
+  struct timespec sent;
+};
+
+bool remote_echo;
+int predict_threshold = -1;  // ms; -1 leaves prediction off
+double srtt = -1;            // smoothed RTT in ms, -1 before the first sample
+struct prediction predictions[PREDICT_MAX];
+int npredictions, nshown;
+
+void predict_push(char c, bool shown)
+{
+  if (npredictions == PREDICT_MAX)
+    return;
+  predictions[npredictions].c = c;
+  predictions[npredictions].shown = shown;
+  if (clock_gettime(CLOCK_MONOTONIC, &predictions[npredictions].sent) == -1)
+    error_and_exit("clock_gettime() failed", strerror(errno), __LINE__);
+  npredictions++;
+  if (shown == true)
+    nshown++;
+}
+
+// Erase the predictions still on screen and forget the rest
+void predict_rollback()
+{
+  for (int i = 0; i < nshown; i++) {
+    if (write(1, "\b \b", 3) == -1)
+      error_and_exit("could not write to stdout: write(1) failed", strerror(errno), __LINE__);
+  }
+  npredictions = nshown = 0;
+}
+
+// Called for each keystroke; returns true if it should be shown now
+bool local_echo(char c)
+{
+  if (remote_echo == false)
+    return true;
+  if (c == 3) {
+    predict_rollback();
+    return false;
+  }
+  if (c == 127) {
+    predict_push('\b', false);
+    predict_push(' ', false);
+    predict_push('\b', false);
+    return false;
+  }
+  if (c == 10 || c == 13) {
+    predict_push('\n', false);
+    return false;
+  }
+  if (c < 32 || c > 126)
+    return false;
+  // Only predict while the cursor is where the predictions left it
+  bool shown = predict_threshold >= 0 && nshown == npredictions &&
+    (srtt < 0 || srtt >= predict_threshold);
+  predict_push(c, shown);
+  return shown;
+}
+
+// Called for each byte from the server; returns true if already on screen
+bool already_shown(char c)
+{
+  if (npredictions == 0)
+    return false;
+  if (predictions[0].c != c) {
+    predict_rollback();
+    return false;
+  }
+  struct timespec now;
+  if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+    error_and_exit("clock_gettime() failed", strerror(errno), __LINE__);
+  double rtt = 1000.0 * (now.tv_sec - predictions[0].sent.tv_sec) +
+    (now.tv_nsec - predictions[0].sent.tv_nsec) / 1000000.0;
+  srtt = srtt < 0 ? rtt : srtt + (rtt - srtt) / 8;
+  if (debug == true)
+    fprintf(stderr, "Echo RTT %.2f ms, smoothed %.2f ms\xD\xA", rtt, srtt);
+
+  bool shown = predictions[0].shown;
+  if (shown == true)
+    nshown--;
+  npredictions--;
+  memmove(predictions, predictions + 1, npredictions * sizeof(predictions[0]));
+  return shown;
+}
+
 void process_input(bool sigpipe, bool log, bool compress)
 {
   struct pollfd fds[2];
@@ -241,10 +498,17 @@ void process_input(bool sigpipe, bool log, bool compress)
 
   // Read input
   const int SIZE = 256;
-  char buf[256];
+  char buf[FRAME_SIZE];
 
   // Set up buffers for compression
-  char compress_in[SIZE], compress_out[CHUNK];
+  struct buffer* raw = pool_get();
+  struct buffer* frame = pool_get();
+  struct buffer* plain = pool_get();
+
+  // Keyboard and server traffic is framed for --compress and --priority;
+  // after an interrupt, output is dropped until the server's FRAME_FLUSH
+  bool framed = compress || priority;
+  bool flushing = false;
 
   while(1) {
     int c = poll(fds,2,0);
@@ -260,8 +524,14 @@ void process_input(bool sigpipe, bool log, bool compress)
     else if (c > 0) {
       // Check which poll succeeded
       int bytes_read;
-      if (fds[0].revents != 0)
+      int control = 0;
+      if (fds[0].revents != 0) {
 	bytes_read = read(0, buf, SIZE);
+	// The server is serviced on the next pass; the relay below keys off revents
+	fds[1].revents = 0;
+      }
+      else if (fds[1].revents != 0 && framed == true)
+	bytes_read = read_frame(server_fd, frame, &control);
       else if (fds[1].revents != 0)
 	bytes_read = read(server_fd, buf, SIZE);
       else { // This should never occur
@@ -284,6 +554,13 @@ void process_input(bool sigpipe, bool log, bool compress)
 	goto end;
       }
 
+      // Drop output the server flushed after our interrupt
+      if (fds[1].revents != 0 && (control == FRAME_FLUSH || flushing == true)) {
+	if (control == FRAME_FLUSH)
+	  flushing = false;
+	continue;
+      }
+
       if (log == true) {
 	char msg[500];
 	if (fds[0].revents != 0)
@@ -295,24 +572,32 @@ void process_input(bool sigpipe, bool log, bool compress)
 	// fprintf(stderr, msg);
       }
 
-      // Decompress received input if necessary
-      if (fds[1].revents != 0 &&  compress == true) {
+      // Unpack (and decompress) received input if necessary
+      if (fds[1].revents != 0 &&  framed == true) {
 	// Log if necessary
-	if (log == true && write(logfile_fd, buf, bytes_read) == -1) {
+	if (log == true && write(logfile_fd, frame->data, frame->len) == -1) {
 	  logfile_error(strerror(errno), __LINE__);
 	}
-	int ret = inf(buf, compress_out, bytes_read);
-	if (ret != Z_OK) {
-	  zerr(ret);
-	  exit(1);
+	plain->len = 0;
+	if (compress == true) {
+	  int ret = inf(frame->data, frame->len, plain);
+	  if (ret != Z_OK) {
+	    zerr(ret);
+	    exit(1);
+	  }
+	}
+	else {
+	  memcpy(plain->data, frame->data, frame->len);
+	  plain->len = frame->len;
 	}
-	strcpy(buf, compress_out);
-	bytes_read = strlen(buf);
+	if (plain->len > FRAME_SIZE)
+	  error_and_exit("invalid frame from server", "frame too large", __LINE__);
+	memcpy(buf, plain->data, plain->len);
+	bytes_read = plain->len;
       }
       if (debug == true) {
-	fprintf(stderr, "buf is now: %s\xD\xA", buf);
+	fprintf(stderr, "buf is now: %.*s\xD\xA", bytes_read, buf);
 	fprintf(stderr, "bytes_read is: %d\xD\xA", bytes_read);
-	fprintf(stderr, "length of buf is: %d\xD\xA", (int)strlen(buf));
       }
 
       // Write buffer
@@ -321,20 +606,20 @@ void process_input(bool sigpipe, bool log, bool compress)
 	case 13:
 	  // Receive <CR> from keyboard, map to <CR><LF> for stdout, <LF> for bash
 	  if (fds[0].revents != 0) {
-	    if (write(1, "\xD\xA", 2) == -1) {
+	    if (local_echo(*(buf+i)) == true && write(1, "\xD\xA", 2) == -1) {
 	      error_and_exit("could not write to stdout: write(1) failed", \
 			     strerror(errno), __LINE__);
 	    }
-	    if (compress == false && sigpipe == false && write(server_fd, "\xA", 1) == -1) {
+	    if (framed == false && sigpipe == false && write(server_fd, "\xA", 1) == -1) {
 	      int errsv = errno;
 	      char msg[500];
 	      sprintf(msg, "could not write to server: write(%d) failed", server_fd);
 	      error_and_exit(msg, strerror(errsv), __LINE__);
 	    }
-	    else if (compress == true && sigpipe == false) {
-	      compress_in[i] = '\xA';
+	    else if (framed == true && sigpipe == false) {
+	      raw->data[i] = '\xA';
 	    }
-	    if (compress == false && log == true && sigpipe == false) {
+	    if (framed == false && log == true && sigpipe == false) {
 	      if (write(logfile_fd, "\xA", 1) == -1)
 		logfile_error(strerror(errno), __LINE__);
 	    }
@@ -344,12 +629,12 @@ void process_input(bool sigpipe, bool log, bool compress)
 	  }
 	  // Receive <CR> from shell, write to stdout unmodified
 	  else if (fds[1].revents != 0) {
-	    if (write(1, buf+i, 1) == -1) {
+	    if (already_shown(*(buf+i)) == false && write(1, buf+i, 1) == -1) {
 	      error_and_exit("could not write to stdout: write(1) failed", \
 			     strerror(errno), __LINE__);
 	    }
 	    
-	    if (log == true && compress == false && write(logfile_fd, buf+i, 1) == -1) {
+	    if (log == true && framed == false && write(logfile_fd, buf+i, 1) == -1) {
 	      logfile_error(strerror(errno), __LINE__);
 	    }
 	    
@@ -361,18 +646,18 @@ void process_input(bool sigpipe, bool log, bool compress)
 	case 10:
 	  // Receive <LF> from keyboard, map to <CR><LF> for stdout, <LF> for bash
 	  if (fds[0].revents != 0) {
-	    if (write(1, "\xD\xA", 2) == -1) {
+	    if (local_echo(*(buf+i)) == true && write(1, "\xD\xA", 2) == -1) {
 	      error_and_exit("could not write to stdout: write(1) failed", \
 			     strerror(errno), __LINE__);
 	    }
-	    if (compress == false && sigpipe == false && write(server_fd, buf+i, 1) == -1) {
+	    if (framed == false && sigpipe == false && write(server_fd, buf+i, 1) == -1) {
 	      int errsv = errno;
 	      char msg[500];
 	      sprintf(msg, "could not write to server: write(%d) failed", server_fd);
 	      error_and_exit(msg, strerror(errsv), __LINE__);
 	    }
-	    else if (compress == true && sigpipe == false) {
-	      compress_in[i] = *(buf+i);
+	    else if (framed == true && sigpipe == false) {
+	      raw->data[i] = *(buf+i);
 	    }
 	    if (log == true && sigpipe == false && write(logfile_fd, buf+i, 1) == -1) {
 	      logfile_error(strerror(errno), __LINE__);
@@ -382,37 +667,39 @@ void process_input(bool sigpipe, bool log, bool compress)
 	  }
 	  // Receive <LF> from shell, map to <CR><LF> for stdout
 	  else {
-	    if (write(1, "\xD\xA", 2) == -1) {
+	    if (already_shown(*(buf+i)) == false && write(1, "\xD\xA", 2) == -1) {
 	      error_and_exit("could not write to stdout: write(1) failed", \
 			     strerror(errno), __LINE__);
 	    }
-	    if (log == true && compress == false && write(logfile_fd, "\xD\xA", 2) == -1) {
+	    if (log == true && framed == false && write(logfile_fd, "\xD\xA", 2) == -1) {
 	      logfile_error(strerror(errno), __LINE__);
 	    }
 	  }
 	  break;
 
 	default:
-	  if (write(1, buf+i, 1) == -1)
-	    error_and_exit("could not write to stdout: write(1) failed", \
-			   strerror(errno), __LINE__);
+	  if (fds[0].revents != 0 ? local_echo(*(buf+i)) == true : already_shown(*(buf+i)) == false) {
+	    if (write(1, buf+i, 1) == -1)
+	      error_and_exit("could not write to stdout: write(1) failed", \
+			     strerror(errno), __LINE__);
+	  }
 	  // Received input from keyboard
 	  if (fds[0].revents != 0) {
 	    if (debug == true)
 	      fprintf(stderr, "Received input from keyboard (line %d)\xD\xA", __LINE__);
-	    if (compress == false && sigpipe == false && write(server_fd, buf+i, 1) == -1) {
+	    if (framed == false && sigpipe == false && write(server_fd, buf+i, 1) == -1) {
 	      int errsv = errno;
 	      char msg[500];
 	      sprintf(msg, "could not write to server: write(%d) failed", server_fd);
 	      error_and_exit(msg, strerror(errsv), __LINE__);
 	    }
-	    else if (compress == true && sigpipe == false) {
+	    else if (framed == true && sigpipe == false) {
 	      if (debug == true)
 		fprintf(stderr, "Compressing keyboard to server (line %d)\xD\xA", __LINE__);
-	      *(compress_in+i) = *(buf+i);
+	      raw->data[i] = *(buf+i);
 	    }
 	    if (log == true && sigpipe == false) {
-	      if (compress == false && write(logfile_fd, buf+i, 1) == -1) {
+	      if (framed == false && write(logfile_fd, buf+i, 1) == -1) {
 		logfile_error(strerror(errno), __LINE__);
 	      }
 	    }
@@ -421,7 +708,7 @@ void process_input(bool sigpipe, bool log, bool compress)
 	  }
 	  // Received input from socket
 	  else {
-	    if (log == true && compress == false && write(logfile_fd, buf+i, 1) == -1) {
+	    if (log == true && framed == false && write(logfile_fd, buf+i, 1) == -1) {
 	      logfile_error(strerror(errno), __LINE__);
 	    }
 	    if (log == true && debug == true) {
@@ -431,9 +718,13 @@ void process_input(bool sigpipe, bool log, bool compress)
 	  break;
 	}    
       }
-      // Compress input if needed
-      if (compress == true) {
-	compress_input_and_write(compress_in, compress_out, bytes_read, log);
+      // Compress or frame keyboard input if needed
+      if (framed == true && sigpipe == false && fds[0].revents != 0) {
+	raw->len = bytes_read;
+	if (priority == true)
+	  flushing = send_keyboard_frames(raw, frame, log, compress) || flushing;
+	else
+	  compress_input_and_write(raw, frame, log);
       }
       if (log == true && write(logfile_fd, "\n", 1) == -1) {
 	logfile_error(strerror(errno), __LINE__-1);
@@ -444,25 +735,331 @@ void process_input(bool sigpipe, bool log, bool compress)
     fds[1].revents = 0;
   }
  end:;
+  pool_put(raw);
+  pool_put(frame);
+  pool_put(plain);
+}
+
+/*
+ * Channel multiplexing (--mux)
+ *
+ * Scripting mode: commands are read line by line from stdin and every
+ * channel's output is printed to stdout one line at a time, prefixed with
+ * its channel ID.  Commands:
+ *   open N         start a shell on channel N
+ *   send N TEXT    send TEXT plus <LF> to channel N (opens it if needed)
+ *   intr N         send SIGINT to channel N's shell
+ *   eof N          close channel N's input
+ * The frame layout and flow control rules match lab2-server.c.
+ */
+#define MUX_HEADER 4
+#define MUX_MAX_CHANNELS 32
+#define MUX_WINDOW 16384
+#define MUX_READ_SIZE FRAME_SIZE
+#define MUX_MAX_PAYLOAD CHUNK
+#define MUX_LINE 4096
+
+enum {
+  MUX_OPEN = 1,
+  MUX_DATA,
+  MUX_EOF,
+  MUX_SIGNAL,
+  MUX_WINDOW_UPDATE,
+  MUX_CLOSE
+};
+
+struct channel {
+  bool open;
+  int send_window;            // input bytes we may still send to the server
+  char pending[MUX_WINDOW];   // script input waiting for window
+  int pending_len;
+  bool eof_requested;
+  int received;               // output printed since the last grant
+  char line[MUX_LINE];        // partial output line
+  int line_len;
+};
+
+struct channel channels[MUX_MAX_CHANNELS];
+int open_channels;
+
+void mux_send(int type, int ch, const char* payload, int len)
+{
+  char frame[MUX_HEADER + MUX_MAX_PAYLOAD];
+  frame[0] = type;
+  frame[1] = ch;
+  frame[2] = (len >> 8) & 0xff;
+  frame[3] = len & 0xff;
+  memcpy(frame + MUX_HEADER, payload, len);
+  write_all(server_fd, frame, MUX_HEADER + len);
+}
+
+void mux_open(int ch)
+{
+  if (channels[ch].open)
+    return;
+  memset(channels + ch, 0, sizeof(struct channel));
+  channels[ch].open = true;
+  channels[ch].send_window = MUX_WINDOW;
+  open_channels++;
+  mux_send(MUX_OPEN, ch, NULL, 0);
+}
+
+// Send as much queued input as the channel's window allows
+void mux_flush_input(int ch, bool compress)
+{
+  struct channel* chan = channels + ch;
+  while (chan->pending_len > 0 && chan->send_window > 0) {
+    int len = chan->pending_len;
+    if (len > chan->send_window)
+      len = chan->send_window;
+    if (len > MUX_READ_SIZE)
+      len = MUX_READ_SIZE;
+    if (compress == true) {
+      struct buffer* out = pool_get();
+      int ret = def(chan->pending, len, out, Z_DEFAULT_COMPRESSION);
+      if (ret != Z_OK) {
+	zerr(ret);
+	exit(1);
+      }
+      mux_send(MUX_DATA, ch, out->data, out->len);
+      pool_put(out);
+    }
+    else
+      mux_send(MUX_DATA, ch, chan->pending, len);
+    memmove(chan->pending, chan->pending + len, chan->pending_len - len);
+    chan->pending_len -= len;
+    chan->send_window -= len;
+  }
+  if (chan->eof_requested && chan->pending_len == 0) {
+    mux_send(MUX_EOF, ch, NULL, 0);
+    chan->eof_requested = false;
+  }
+}
+
+void mux_print_line(int ch)
+{
+  char prefix[16];
+  sprintf(prefix, "[%d] ", ch);
+  write_all(1, prefix, strlen(prefix));
+  write_all(1, channels[ch].line, channels[ch].line_len);
+  write_all(1, "\n", 1);
+  channels[ch].line_len = 0;
+}
+
+void mux_output(int ch, const char* buf, int len)
+{
+  struct channel* chan = channels + ch;
+  for (int i = 0; i < len; i++) {
+    if (buf[i] == '\n') {
+      mux_print_line(ch);
+      continue;
+    }
+    if (chan->line_len == MUX_LINE)
+      mux_print_line(ch);
+    chan->line[chan->line_len++] = buf[i];
+  }
+
+  // Output is on stdout, so hand the window back to the server
+  chan->received += len;
+  if (chan->received >= MUX_WINDOW / 2) {
+    int credit = chan->received;
+    char payload[4] = {(credit >> 24) & 0xff, (credit >> 16) & 0xff,
+		       (credit >> 8) & 0xff, credit & 0xff};
+    mux_send(MUX_WINDOW_UPDATE, ch, payload, 4);
+    chan->received = 0;
+  }
+}
+
+void mux_process_frame(int type, int ch, char* payload, int len, bool compress)
+{
+  if (ch >= MUX_MAX_CHANNELS || channels[ch].open == false)
+    error_and_exit("invalid frame from server", "bad channel", __LINE__);
+  struct channel* chan = channels + ch;
+
+  switch (type) {
+  case MUX_DATA: {
+    struct buffer* plain = pool_get();
+    if (compress == true) {
+      int ret = inf(payload, len, plain);
+      if (ret != Z_OK) {
+	zerr(ret);
+	exit(1);
+      }
+      payload = plain->data;
+      len = plain->len;
+    }
+    mux_output(ch, payload, len);
+    pool_put(plain);
+    break;
+  }
+  case MUX_WINDOW_UPDATE:
+    if (len == 4)
+      chan->send_window += ((payload[0] & 0xff) << 24) | ((payload[1] & 0xff) << 16) |
+	((payload[2] & 0xff) << 8) | (payload[3] & 0xff);
+    mux_flush_input(ch, compress);
+    break;
+  case MUX_CLOSE: {
+    if (chan->line_len > 0)
+      mux_print_line(ch);
+    char msg[50];
+    sprintf(msg, "[%d] exit status %d\n", ch, len == 1 ? payload[0] & 0xff : -1);
+    write_all(1, msg, strlen(msg));
+    chan->open = false;
+    open_channels--;
+    break;
+  }
+  default:
+    error_and_exit("invalid frame from server", "unknown frame type", __LINE__);
+  }
+}
+
+// Run one script line; false if it must wait for window space
+bool mux_command(char* line, bool compress)
+{
+  char cmd[16];
+  int ch, text = 0;
+  if (sscanf(line, "%15s %d %n", cmd, &ch, &text) < 2 || ch < 0 || ch >= MUX_MAX_CHANNELS) {
+    if (line[0] != '\0')
+      fprintf(stderr, "Invalid command: %s\n", line);
+    return true;
+  }
+  struct channel* chan = channels + ch;
+
+  if (strcmp(cmd, "open") == 0)
+    mux_open(ch);
+  else if (strcmp(cmd, "send") == 0) {
+    int len = strlen(line + text);
+    if (chan->open && chan->pending_len + len + 1 > MUX_WINDOW)
+      return false;
+    mux_open(ch);
+    memcpy(chan->pending + chan->pending_len, line + text, len);
+    chan->pending[chan->pending_len + len] = '\n';
+    chan->pending_len += len + 1;
+    mux_flush_input(ch, compress);
+  }
+  else if (strcmp(cmd, "intr") == 0 && chan->open) {
+    char sig = SIGINT;
+    mux_send(MUX_SIGNAL, ch, &sig, 1);
+  }
+  else if (strcmp(cmd, "eof") == 0 && chan->open) {
+    chan->eof_requested = true;
+    mux_flush_input(ch, compress);
+  }
+  else
+    fprintf(stderr, "Invalid command: %s\n", line);
+  return true;
+}
+
+int process_mux(bool compress)
+{
+  char script[MUX_LINE];
+  int script_len = 0;
+  bool script_eof = false, blocked = false;
+  char inbuf[MUX_HEADER + MUX_MAX_PAYLOAD];
+  int inlen = 0;
+
+  while (script_eof == false || open_channels > 0) {
+    struct pollfd fds[2];
+    fds[0].fd = server_fd;
+    fds[0].events = POLLIN;
+    // Stop reading the script while a command is waiting for window
+    fds[1].fd = (script_eof || blocked || script_len == MUX_LINE) ? -1 : 0;
+    fds[1].events = POLLIN;
+    fds[0].revents = fds[1].revents = 0;
+
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR)
+	continue;
+      error_and_exit("poll() failed", strerror(errno), __LINE__);
+    }
+
+    if (fds[0].revents != 0) {
+      int bytes_read = read(server_fd, inbuf + inlen, sizeof(inbuf) - inlen);
+      if (bytes_read < 0)
+	error_and_exit("could not read from socket: read() failed", strerror(errno), __LINE__);
+      if (bytes_read == 0)
+	break;
+      inlen += bytes_read;
+
+      int offset = 0;
+      while (inlen - offset >= MUX_HEADER) {
+	int len = ((inbuf[offset+2] & 0xff) << 8) | (inbuf[offset+3] & 0xff);
+	if (len > MUX_MAX_PAYLOAD)
+	  error_and_exit("invalid frame from server", "payload too large", __LINE__);
+	if (inlen - offset < MUX_HEADER + len)
+	  break;
+	mux_process_frame(inbuf[offset] & 0xff, inbuf[offset+1] & 0xff,
+			  inbuf + offset + MUX_HEADER, len, compress);
+	offset += MUX_HEADER + len;
+      }
+      memmove(inbuf, inbuf + offset, inlen - offset);
+      inlen -= offset;
+    }
+
+    if (fds[1].revents != 0) {
+      int bytes_read = read(0, script + script_len, sizeof(script) - script_len);
+      if (bytes_read < 0)
+	error_and_exit("could not read from stdin: read() failed", strerror(errno), __LINE__);
+      if (bytes_read == 0)
+	script_eof = true;
+      script_len += bytes_read;
+    }
+
+    // Run every complete command that fits
+    blocked = false;
+    char* newline;
+    while ((newline = memchr(script, '\n', script_len)) != NULL) {
+      *newline = '\0';
+      if (mux_command(script, compress) == false) {
+	*newline = '\n';
+	blocked = true;
+	break;
+      }
+      int used = newline - script + 1;
+      memmove(script, script + used, script_len - used);
+      script_len -= used;
+    }
+    if (script_len == MUX_LINE && blocked == false)
+      error_and_exit("could not read script", "command too long", __LINE__);
+  }
+  return 0;
+}
+
+// Fill in a Unix domain address; a leading '@' selects the abstract namespace
+socklen_t set_unix_addr(struct sockaddr_un* addr, const char* path)
+{
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  size_t len = strlen(path);
+  if (len == 0 || len >= sizeof(addr->sun_path)) {
+    fprintf(stderr, "Invalid socket path: %s\n", path);
+    exit(1);
+  }
+  memcpy(addr->sun_path, path, len);
+  if (path[0] == '@')
+    addr->sun_path[0] = '\0';
+  return offsetof(struct sockaddr_un, sun_path) + len;
 }
 
 int main(int argc, char* argv[])
 {
-  // Save terminal attributes
-  if (tcgetattr(0, &termios_save) == -1)
-    fprintf(stderr, "ERROR: tcgetattr() failed at line %d: %s\n", __LINE__, strerror(errno));
-  
   // Setup argument processing
   int port = 0;
   int longindex;
   bool log = false, compress = false;
   debug = false;
   char* logfile;
+  char* unix_path = NULL;
   static struct option long_options[] = {
     {"port", required_argument, 0, 0},
     {"log", required_argument, 0, 0},
     {"compress", no_argument, 0, 0},
     {"debug", no_argument, 0, 0},
+    {"unix", required_argument, 0, 0},
+    {"mux", no_argument, 0, 0},
+    {"priority", no_argument, 0, 0},
+    {"remote-echo", no_argument, 0, 0},
+    {"predict", optional_argument, 0, 0},
     {0, 0, 0, 0}
   };
   
@@ -497,6 +1094,37 @@ int main(int argc, char* argv[])
     }
     else if (longindex == 3)
       debug = true;
+    else if (longindex == 4)
+      unix_path = optarg;
+    else if (longindex == 5)
+      mux = true;
+    else if (longindex == 6)
+      priority = true;
+    else if (longindex == 7)
+      remote_echo = true;
+    else if (longindex == 8) {
+      remote_echo = true;
+      predict_threshold = optarg != NULL ? atoi(optarg) : 30;
+      if (predict_threshold < 0) {
+	fprintf(stderr, "Invalid prediction threshold: %s\n", optarg);
+	exit(1);
+      }
+    }
+  }
+
+  // Mux frames carry their own control types
+  if (mux == true)
+    priority = false;
+
+  // Save terminal attributes
+  if (mux == false && tcgetattr(0, &termios_save) == -1)
+    fprintf(stderr, "ERROR: tcgetattr() failed at line %d: %s\n", __LINE__, strerror(errno));
+
+  // Same rule as the server: no compression over a same-host Unix socket
+  if (unix_path != NULL && compress == true) {
+    if (debug == true)
+      fprintf(stderr, "Unix socket: compression disabled\n");
+    compress = false;
   }
   /*
   if (port == 0) {
@@ -524,34 +1152,52 @@ int main(int argc, char* argv[])
   
   // Create socket
   {
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    server_fd = socket(unix_path != NULL ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
     int errsv = errno;
     if (server_fd == -1)
       error_and_exit("socket() failed", strerror(errsv), __LINE__);
   }
 
-  // Get host address
-  struct hostent *host_info;
-  {
-    host_info = gethostbyname("localhost"); // Optional --host option
-    int errsv = errno;
-    if (host_info == NULL)
-      error_and_exit("gethostbyname() failed", strerror(errsv), __LINE__);
+  if (unix_path != NULL) {
+    struct sockaddr_un serv_addr;
+    socklen_t addr_len = set_unix_addr(&serv_addr, unix_path);
+
+    // Connect to server
+    if (connect(server_fd, (struct sockaddr*)&serv_addr, addr_len) == -1)
+      error_and_exit("connect() failed", strerror(errno), __LINE__);
   }
+  else {
+    // Get host address
+    struct hostent *host_info;
+    {
+      host_info = gethostbyname("localhost"); // Optional --host option
+      int errsv = errno;
+      if (host_info == NULL)
+	error_and_exit("gethostbyname() failed", strerror(errsv), __LINE__);
+    }
   
-  struct sockaddr_in serv_addr;
-  memset(&serv_addr, 0, sizeof(serv_addr));
-  serv_addr.sin_family = AF_INET;
-  memcpy(&serv_addr.sin_addr.s_addr, host_info->h_addr_list[0], host_info->h_length);
-  serv_addr.sin_port = htons(port); // htons(portno)
-
-  // Connect to server
-  if (connect(server_fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) == -1)
-    error_and_exit("connect() failed", strerror(errno), __LINE__);
+    struct sockaddr_in serv_addr;
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    memcpy(&serv_addr.sin_addr.s_addr, host_info->h_addr_list[0], host_info->h_length);
+    serv_addr.sin_port = htons(port); // htons(portno)
+
+    // Connect to server
+    if (connect(server_fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) == -1)
+      error_and_exit("connect() failed", strerror(errno), __LINE__);
+  }
   
   if (debug == true)
     printf("Connected to server! (line %d)\n", __LINE__);
 
+  pool_init();
+  if (mux == true) {
+    int exit_value = process_mux(compress);
+    if (close(server_fd) == -1)
+      error_and_exit("could not close socket: close() failed", strerror(errno), __LINE__);
+    exit(exit_value);
+  }
+
   // Set new attributes
   struct termios termios_new = termios_save;
   termios_new.c_iflag = ISTRIP;
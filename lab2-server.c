@@ -1,4 +1,4 @@
-#define _POSIX_SOURCE
+#define _POSIX_C_SOURCE 200112L
 #include <termios.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,15 +9,23 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <signal.h>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <sys/un.h>
+#include <stddef.h>
 #include "zlib.h"
 
-bool debug, _compress;
+#include "relay.h"
+
+bool debug, _compress, priority, framed;
 int child_pid, client_sockfd;
 int pipefd_to_bash[2], pipefd_to_term[2];
 
@@ -27,14 +35,6 @@ void error_and_exit(const char* message, const char* error, const int line)
   exit(1);
 }
 
-void error_and_exit_child(const char* message, const char* error, int parentfd, int line)
-{
-  // We don't reset terminal here since fd 0 has likely been replaced already
-  write(parentfd, "\x4", 1);
-  fprintf(stderr, "ERROR: %s at line %d: %s\xD\xA", message, line, error);
-  exit(1);
-}
-
 int print_exit_status()
 {
   int wstatus = 0;
@@ -51,70 +51,134 @@ int print_exit_status()
 }
 
 #define CHUNK 16384
-int inf(char* src, char* dest, const int SIZE)
+#define FRAME_SIZE 4096    // largest uncompressed frame either end deflates
+#define FRAME_HEADER 2     // 16-bit length in front of each frame
+#define FRAME_CONTROL 0x8000  // header bit marking a control frame
+#define PIPELINE_SLOTS 64
+#define OUTQ_FRAMES 32
+#define OUTQ_CONTROL 1  // output queue slots kept for control frames
+#define POOL_BUFFERS (2 * PIPELINE_SLOTS + OUTQ_FRAMES + 8)
+
+// Control frame codes (--priority)
+enum {
+  FRAME_INTR = 1,  // client -> server: interrupt the shell
+  FRAME_EOF,       // client -> server: close the shell's input
+  FRAME_FLUSH      // server -> client: output dropped by an interrupt ends here
+};
+
+/*
+ * Length-tracked buffers for the compression path.  Every buffer comes out of
+ * one arena allocated at startup and is big enough for a deflated FRAME_SIZE
+ * frame plus its header, so relaying never allocates or truncates a buffer.  The pool
+ * is only touched by the I/O thread.
+ */
+struct buffer {
+  char* data;
+  int len;
+  int size;
+};
+
+struct buffer_pool {
+  char* arena;
+  struct buffer buffers[POOL_BUFFERS];
+  struct buffer* free[POOL_BUFFERS];
+  int nfree;
+};
+
+struct buffer_pool pool;
+
+void pool_init()
 {
-  int ret;
-  unsigned have;
-  unsigned i = 0;
+  // Size buffers from deflateBound(), plus room for the sync flush marker
   z_stream strm;
-  unsigned char out[CHUNK];
-
-  /* allocate inflate state */
   strm.zalloc = Z_NULL;
   strm.zfree = Z_NULL;
   strm.opaque = Z_NULL;
-  strm.avail_in = 0;
-  strm.next_in = Z_NULL;
-  ret = inflateInit(&strm);
-  if (ret != Z_OK)
-    return ret;
-  if (debug == true)
-    fprintf(stderr, "Finished inflateInit() (line %d)\xD\xA", __LINE__);
-  strm.avail_in = SIZE;
-  strm.next_in = (Bytef*)src;
-  do {
-    strm.avail_out = CHUNK;
-    strm.next_out = out;
-    ret = inflate(&strm, Z_SYNC_FLUSH);
+  if (deflateInit(&strm, Z_DEFAULT_COMPRESSION) != Z_OK)
+    error_and_exit("could not size buffers", "deflateInit() failed", __LINE__);
+  int size = deflateBound(&strm, FRAME_SIZE) + 6;
+  (void)deflateEnd(&strm);
+  if (size < FRAME_SIZE)
+    size = FRAME_SIZE;
+  size += FRAME_HEADER;
 
-    if (debug == true)
-      fprintf(stderr, "Value of ret is: %d\xD\xA", ret);
-  
-    switch(ret) {
-    case Z_NEED_DICT:
-      ret = Z_DATA_ERROR;
-    case Z_DATA_ERROR:
-    case Z_MEM_ERROR:
-      (void)inflateEnd(&strm);
-      return ret;
-    }
+  pool.arena = malloc((size_t)size * POOL_BUFFERS);
+  if (pool.arena == NULL)
+    error_and_exit("could not allocate buffers: malloc() failed", strerror(errno), __LINE__);
+  for (int i = 0; i < POOL_BUFFERS; i++) {
+    pool.buffers[i].data = pool.arena + (size_t)size * i;
+    pool.buffers[i].size = size;
+    pool.free[i] = pool.buffers + i;
+  }
+  pool.nfree = POOL_BUFFERS;
+}
+
+struct buffer* pool_get()
+{
+  if (pool.nfree == 0)
+    error_and_exit("could not get buffer", "buffer pool exhausted", __LINE__);
+  struct buffer* b = pool.free[--pool.nfree];
+  b->len = 0;
+  return b;
+}
+
+void pool_put(struct buffer* b)
+{
+  pool.free[pool.nfree++] = b;
+}
 
+/*
+ * Each frame is compressed on its own, but the zlib state is not: every
+ * thread keeps one stream per direction, set up on first use and reset for
+ * each frame, so zlib allocates its window and tables once instead of per
+ * frame.
+ */
+static __thread z_stream inf_strm, def_strm;
+static __thread bool inf_ready, def_ready;
+static __thread int def_level;
+
+// Inflate SIZE bytes of src, appending the result to dest
+int inf(const char* src, const int SIZE, struct buffer* dest)
+{
+  int ret;
+  z_stream* strm = &inf_strm;
+
+  if (inf_ready == false) {
+    /* allocate inflate state */
+    strm->zalloc = Z_NULL;
+    strm->zfree = Z_NULL;
+    strm->opaque = Z_NULL;
+    strm->avail_in = 0;
+    strm->next_in = Z_NULL;
+    ret = inflateInit(strm);
+    if (ret != Z_OK)
+      return ret;
+    inf_ready = true;
     if (debug == true)
-      fprintf(stderr, "Value of ret is: %d\xD\xA", ret);
+      fprintf(stderr, "Finished inflateInit() (line %d)\xD\xA", __LINE__);
+  }
+  else if ((ret = inflateReset(strm)) != Z_OK)
+    return ret;
 
-    have = CHUNK - strm.avail_out;
-    // Write out to dest
-    strncpy(dest+i, (char*)out, have);
-    i += have;
-  } while (strm.avail_out == 0);
+  strm->avail_in = SIZE;
+  strm->next_in = (Bytef*)src;
+  strm->avail_out = dest->size - dest->len;
+  strm->next_out = (Bytef*)(dest->data + dest->len);
+  ret = inflate(strm, Z_SYNC_FLUSH);
+  if (ret == Z_NEED_DICT)
+    ret = Z_DATA_ERROR;
+  // Input left over means the frame is bigger than any sender produces
+  if (ret == Z_OK && strm->avail_in != 0)
+    ret = Z_BUF_ERROR;
+  dest->len = dest->size - strm->avail_out;
 
-  // Set null byte
-  *(dest+i) = '\0';
-  
   if (debug == true) {
     fprintf(stderr, "Finished inflate() (line %d)\xD\xA", __LINE__);
-    fprintf(stderr, "Input buffer: %s\xD\xA", src);
-    fprintf(stderr, "Output buffer: %s\xD\xA", dest);
-    fprintf(stderr, "Length of output buffer: %d\xD\xA", (int)strlen(dest));
-    fprintf(stderr, "Value of i is: %d\xD\xA", i);
+    fprintf(stderr, "Value of ret is: %d\xD\xA", ret);
+    fprintf(stderr, "Length of output buffer: %d\xD\xA", dest->len);
   }
 
-  (void)inflateEnd(&strm);
-  if (debug == true)
-    fprintf(stderr, "Finished inflateEnd() (line %d)\xD\xA", __LINE__);
-  if (debug == true)
-    fprintf(stderr, "Returning from inf() now (line %d)\xD\xA", __LINE__);
-  return ret == Z_OK ? Z_OK : Z_DATA_ERROR;
+  return ret == Z_OK || ret == Z_STREAM_END ? Z_OK : ret;
 }
 
 /* report a zlib or i/o error */
@@ -137,96 +201,680 @@ void zerr(int ret)
   case Z_MEM_ERROR:
     fputs("out of memory\n", stderr);
     break;
+  case Z_BUF_ERROR:
+    fputs("frame larger than buffer\n", stderr);
+    break;
   case Z_VERSION_ERROR:
     fputs("zlib version mismatch!\n", stderr);
   }
 }
 
-#define CHUNK 16384
-int def(char *src, char *dest, const int SIZE, int level)
+// Deflate SIZE bytes of src, appending the result to dest
+int def(const char* src, const int SIZE, struct buffer* dest, int level)
 {
   if (debug == true)
     fprintf(stderr, "Starting deflate function (line %d)\xD\xA", __LINE__);
-  
-  int ret, flush;
-  unsigned have;
-  unsigned i = 0;
-  z_stream strm;
-  //unsigned char in[CHUNK];
-  unsigned char out[CHUNK];
 
-  if (debug == true)
-    fprintf(stderr, "Finished declaring variables (line %d)\xD\xA", __LINE__);
-  
-  /* allocate deflate state */
-  strm.zalloc = Z_NULL;
-  strm.zfree = Z_NULL;
-  strm.opaque = Z_NULL;
-  if (debug == true)
-    fprintf(stderr, "Before calling deflateInit() (line %d)\xD\xA", __LINE__);
-  ret = deflateInit(&strm, level);
-  if (debug == true)
-    fprintf(stderr, "Finished calling deflateInit() (line %d)\xD\xA", __LINE__);
-  if (ret != Z_OK)
+  int ret;
+  z_stream* strm = &def_strm;
+
+  // A new level needs a new stream
+  if (def_ready == true && level != def_level) {
+    (void)deflateEnd(strm);
+    def_ready = false;
+  }
+  if (def_ready == false) {
+    /* allocate deflate state */
+    strm->zalloc = Z_NULL;
+    strm->zfree = Z_NULL;
+    strm->opaque = Z_NULL;
+    ret = deflateInit(strm, level);
+    if (ret != Z_OK)
+      return ret;
+    def_ready = true;
+    def_level = level;
+  }
+  else if ((ret = deflateReset(strm)) != Z_OK)
     return ret;
-  
-  if (debug == true) {
-    fprintf(stderr, "Finished allocating deflate state (line %d)\xD\xA", __LINE__);
-    fprintf(stderr, "Byte size is: %d\xD\xA", SIZE);
-  }
-
-  strm.avail_in = SIZE;
-  flush = Z_SYNC_FLUSH;
-  strm.next_in = (Bytef*)src;
-  do {
-    strm.avail_out = CHUNK;
-    strm.next_out = out;
-    ret = deflate(&strm, flush);
-    have = CHUNK - strm.avail_out;
-    // Save to dest buffer
-    strncpy(dest+i,(char*)out,have);
-    i += have;
-  } while (strm.avail_out == 0);
-  // Insert null byte
-  *(dest+i) = '\0';
-  if (debug == true)
-    fprintf(stderr, "Finished deflate() (line %d)\xD\xA", __LINE__);
-  (void)deflateEnd(&strm);
+
+  strm->avail_in = SIZE;
+  strm->next_in = (Bytef*)src;
+  strm->avail_out = dest->size - dest->len;
+  strm->next_out = (Bytef*)(dest->data + dest->len);
+  ret = deflate(strm, Z_SYNC_FLUSH);
+  // Buffers are sized from deflateBound(), so a single call always fits
+  if (ret == Z_OK && (strm->avail_in != 0 || strm->avail_out == 0))
+    ret = Z_BUF_ERROR;
+  dest->len = dest->size - strm->avail_out;
+
   if (debug == true) {
     fprintf(stderr, "Finished compressing input (line %d)\xD\xA", __LINE__);
-    fprintf(stderr, "Output buffer: %s\xD\xA", dest);
-    fprintf(stderr, "Length of output buffer is: %d\xD\xA", (int)strlen(dest));
-    fprintf(stderr, "Total bytes is: %d\xD\xA", i);
+    fprintf(stderr, "Input bytes: %d, total bytes: %d\xD\xA", SIZE, dest->len);
   }
-  return i;
+  return ret;
 }
 
-void compress_input_and_write(char* compress_in, char* compress_out, const int bytes_read)
+void write_all(int fd, const char* buf, int len)
 {
-  if (debug == true)
-    fprintf(stderr, "Compressing input (line %d)\xD\xA", __LINE__);
-  int compress_size = def(compress_in, compress_out, bytes_read, Z_DEFAULT_COMPRESSION);
-  //compress_size = 4; //(int)strlen(compress_out);
+  while (len > 0) {
+    int n = write(fd, buf, len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1)
+      error_and_exit("could not write to socket: write() failed", strerror(errno), __LINE__);
+    buf += n;
+    len -= n;
+  }
+}
 
-  if (debug == true) {
-    fprintf(stderr, "Uncompressed input: %s\xD\xA", compress_in);
-    fprintf(stderr, "Compressed buffer: %s\xD\xA", compress_out);
-    fprintf(stderr, "Length of compressed buffer: %d\xD\xA", compress_size);
-    fprintf(stderr, "Contents of buffer: ");
-    write(2, compress_out, 100);
-    fprintf(stderr, "\xD\xA");
+// Read exactly len bytes; returns 0 on EOF before the first byte
+int read_all(int fd, char* buf, int len)
+{
+  int total = 0;
+  while (total < len) {
+    int n = read(fd, buf + total, len - total);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1)
+      error_and_exit("could not read from socket: read() failed", strerror(errno), __LINE__);
+    if (n == 0 && total == 0)
+      return 0;
+    if (n == 0)
+      error_and_exit("could not read from socket", "connection closed mid-frame", __LINE__);
+    total += n;
+  }
+  return total;
+}
+
+// Pack src into frame as <length><payload>, deflated with --compress
+void build_frame(const char* src, const int SIZE, struct buffer* frame)
+{
+  frame->len = FRAME_HEADER;
+  if (_compress == true) {
+    int ret = def(src, SIZE, frame, Z_DEFAULT_COMPRESSION);
+    if (ret != Z_OK) {
+      zerr(ret);
+      exit(1);
+    }
+  }
+  else {
+    memcpy(frame->data + FRAME_HEADER, src, SIZE);
+    frame->len += SIZE;
   }
+  int payload = frame->len - FRAME_HEADER;
+  frame->data[0] = (payload >> 8) & 0xff;
+  frame->data[1] = payload & 0xff;
+}
+
+// Read one frame's payload; returns its length, 0 on EOF.  For a control
+// frame the code goes in *control and FRAME_HEADER is returned.
+int read_frame(int fd, struct buffer* frame, int* control)
+{
+  char header[FRAME_HEADER];
+  if (read_all(fd, header, FRAME_HEADER) == 0)
+    return 0;
+  frame->len = ((header[0] & 0xff) << 8) | (header[1] & 0xff);
+  *control = 0;
+  if (frame->len & FRAME_CONTROL) {
+    *control = frame->len & ~FRAME_CONTROL;
+    frame->len = 0;
+    return FRAME_HEADER;
+  }
+  if (frame->len == 0 || frame->len > frame->size)
+    error_and_exit("invalid frame from client", "bad frame length", __LINE__);
+  read_all(fd, frame->data, frame->len);
+  return frame->len;
+}
+
+void compress_input_and_write(struct buffer* raw, struct buffer* frame)
+{
+  if (debug == true)
+    fprintf(stderr, "Compressing input (line %d)\xD\xA", __LINE__);
+  build_frame(raw->data, raw->len, frame);
   // Write compressed input out to client
-  if (write(client_sockfd, compress_out, compress_size) == -1)
-    error_and_exit("could not write to server: write() failed", strerror(errno), __LINE__);
+  write_all(client_sockfd, frame->data, frame->len);
 
   if (debug == true)
     fprintf(stderr, "Finished compress_input_and_write() (line %d)\xD\xA", __LINE__);
 }
 
+/*
+ * Compression pipeline (--compress-thread)
+ *
+ * process_input() hands raw shell output to a worker thread through a
+ * single-producer/single-consumer ring and gets deflated frames back through
+ * a second ring, so a large burst never holds up reading the socket.  The
+ * rings are lock-free; the pipes only carry wakeups.  At most PIPELINE_SLOTS
+ * frames are in flight, so the return ring can never fill up.  Each slot owns
+ * a pool buffer; submitting swaps the caller's buffer for the slot's.
+ */
+struct ring {
+  struct buffer* slots[PIPELINE_SLOTS];
+  unsigned head, tail;  // head is advanced by the consumer, tail by the producer
+};
+
+bool pipeline;
+struct ring raw_ring, deflated_ring;
+int discard_in_flight;  // pipeline frames submitted before an interrupt
+void outq_push(struct buffer* frame, bool control);
+int wake_worker[2], wake_io[2];
+int in_flight;
+pthread_t compress_thread;
+
+struct buffer** ring_reserve(struct ring* r)
+{
+  if (r->tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == PIPELINE_SLOTS)
+    return NULL;
+  return r->slots + r->tail % PIPELINE_SLOTS;
+}
+
+void ring_publish(struct ring* r)
+{
+  __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+
+struct buffer** ring_front(struct ring* r)
+{
+  if (r->head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return r->slots + r->head % PIPELINE_SLOTS;
+}
+
+void ring_release(struct ring* r)
+{
+  __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+void* compress_worker(void* arg)
+{
+  (void)arg;
+  char wakeup[64];
+  // The I/O thread closes its end of the pipe to stop us
+  while (read(wake_worker[0], wakeup, sizeof(wakeup)) > 0) {
+    struct buffer** in;
+    while ((in = ring_front(&raw_ring)) != NULL) {
+      build_frame((*in)->data, (*in)->len, *ring_reserve(&deflated_ring));
+      ring_release(&raw_ring);
+      ring_publish(&deflated_ring);
+      if (write(wake_io[1], "", 1) == -1)
+	error_and_exit("could not wake I/O thread: write() failed", strerror(errno), __LINE__);
+    }
+  }
+  return NULL;
+}
+
+void pipeline_start()
+{
+  for (int i = 0; i < PIPELINE_SLOTS; i++) {
+    raw_ring.slots[i] = pool_get();
+    deflated_ring.slots[i] = pool_get();
+  }
+  if (pipe(wake_worker) == -1 || pipe(wake_io) == -1)
+    error_and_exit("unable to initialize pipeline: pipe() failed", strerror(errno), __LINE__);
+  int c = pthread_create(&compress_thread, NULL, compress_worker, NULL);
+  if (c != 0)
+    error_and_exit("pthread_create() failed", strerror(c), __LINE__);
+}
+
+void pipeline_submit(struct buffer** raw)
+{
+  struct buffer** slot = ring_reserve(&raw_ring);
+  struct buffer* spare = *slot;
+  *slot = *raw;
+  *raw = spare;
+  (*raw)->len = 0;
+  ring_publish(&raw_ring);
+  in_flight++;
+  if (write(wake_worker[1], "", 1) == -1)
+    error_and_exit("could not wake compression thread: write() failed", strerror(errno), __LINE__);
+}
+
+// Write every frame the worker has finished to the client
+void pipeline_collect()
+{
+  char wakeup[64];
+  if (read(wake_io[0], wakeup, sizeof(wakeup)) == -1)
+    error_and_exit("could not read from compression thread: read() failed", strerror(errno), __LINE__);
+  struct buffer** out;
+  while ((out = ring_front(&deflated_ring)) != NULL) {
+    if (priority == false)
+      write_all(client_sockfd, (*out)->data, (*out)->len);
+    else if (discard_in_flight > 0)
+      discard_in_flight--;
+    else {
+      struct buffer* frame = pool_get();
+      memcpy(frame->data, (*out)->data, (*out)->len);
+      frame->len = (*out)->len;
+      outq_push(frame, false);
+    }
+    ring_release(&deflated_ring);
+    in_flight--;
+  }
+}
+
+void pipeline_drain()
+{
+  while (in_flight > 0)
+    pipeline_collect();
+}
+
+void pipeline_stop()
+{
+  pipeline_drain();
+  close(wake_worker[1]);
+  int c = pthread_join(compress_thread, NULL);
+  if (c != 0)
+    error_and_exit("pthread_join() failed", strerror(c), __LINE__);
+}
+
+/*
+ * Output queue (--priority)
+ *
+ * Frames for the client wait here and go out as fast as the socket takes
+ * them, so a slow client never blocks the relay loop and control frames are
+ * read as soon as they arrive.  An interrupt drops every queued frame the
+ * client has not started to receive and queues FRAME_FLUSH in their place.
+ * Callers hold off reading more output while outq_room() is used up; the
+ * last OUTQ_CONTROL slots only take control frames.
+ */
+struct buffer* outq[OUTQ_FRAMES];
+int outq_head, outq_len, outq_sent;
+
+// Output frames that may still be queued
+int outq_room()
+{
+  return OUTQ_FRAMES - OUTQ_CONTROL - outq_len;
+}
+
+void outq_push(struct buffer* frame, bool control)
+{
+  if (outq_len == OUTQ_FRAMES || (control == false && outq_room() <= 0))
+    error_and_exit("could not queue frame for client", "output queue full", __LINE__);
+  outq[(outq_head + outq_len) % OUTQ_FRAMES] = frame;
+  outq_len++;
+}
+
+void outq_send()
+{
+  while (outq_len > 0) {
+    struct buffer* head = outq[outq_head];
+    int n = send(client_sockfd, head->data + outq_sent, head->len - outq_sent, MSG_DONTWAIT);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      return;
+    if (n == -1)
+      error_and_exit("could not write to socket: send() failed", strerror(errno), __LINE__);
+    outq_sent += n;
+    if (outq_sent == head->len) {
+      pool_put(head);
+      outq_head = (outq_head + 1) % OUTQ_FRAMES;
+      outq_len--;
+      outq_sent = 0;
+    }
+  }
+}
+
+// Wait until the socket takes more of the queue
+void outq_wait()
+{
+  struct pollfd out = {client_sockfd, POLLOUT, 0};
+  if (poll(&out, 1, -1) == -1 && errno != EINTR)
+    error_and_exit("poll() failed", strerror(errno), __LINE__);
+  outq_send();
+}
+
+void outq_drain()
+{
+  while (outq_len > 0)
+    outq_wait();
+}
+
+void queue_output(struct buffer* raw)
+{
+  struct buffer* frame = pool_get();
+  build_frame(raw->data, raw->len, frame);
+  outq_push(frame, false);
+}
+
+void queue_control(int code)
+{
+  struct buffer* frame = pool_get();
+  frame->data[0] = ((FRAME_CONTROL | code) >> 8) & 0xff;
+  frame->data[1] = code & 0xff;
+  frame->len = FRAME_HEADER;
+  outq_push(frame, true);
+}
+
+/*
+ * Screen mode (--screen[=FPS])
+ *
+ * Shell output feeds a SCREEN_ROWS x SCREEN_COLS model through a small VT
+ * parser (printable ASCII, CR/LF/BS/TAB and the common CSI cursor and erase
+ * sequences; attributes are dropped).  At most FPS times a second, and only
+ * once the client has taken the previous frame, the rows that differ from
+ * what the client last saw are sent as cursor-addressed updates.  Output the
+ * client had no time to see is never sent at all.
+ */
+#define SCREEN_ROWS 24
+#define SCREEN_COLS 80
+#define SCREEN_PARAMS 8
+
+enum { VT_GROUND, VT_ESC, VT_CSI, VT_OSC };
+
+struct screen {
+  char cells[SCREEN_ROWS][SCREEN_COLS];
+  int row, col;
+  int state;
+  int params[SCREEN_PARAMS];
+  int nparams;
+};
+
+bool screen_mode, screen_dirty, screen_started;
+int screen_fps;
+struct screen screen;
+char sent_cells[SCREEN_ROWS][SCREEN_COLS];  // what the client shows
+struct timespec screen_last;
+
+void screen_clear(int row, int from, int to)
+{
+  memset(screen.cells[row] + from, ' ', to - from);
+}
+
+void screen_newline()
+{
+  if (screen.row < SCREEN_ROWS - 1) {
+    screen.row++;
+    return;
+  }
+  memmove(screen.cells[0], screen.cells[1], (SCREEN_ROWS - 1) * SCREEN_COLS);
+  screen_clear(SCREEN_ROWS - 1, 0, SCREEN_COLS);
+}
+
+int screen_param(int i, int fallback)
+{
+  return i < screen.nparams && screen.params[i] > 0 ? screen.params[i] : fallback;
+}
+
+int clamp(int value, int low, int high)
+{
+  return value < low ? low : value > high ? high : value;
+}
+
+void screen_csi(char final)
+{
+  int n = screen_param(0, 1);
+  int mode = screen.nparams > 0 ? screen.params[0] : 0;
+  switch (final) {
+  case 'H':
+  case 'f':
+    screen.row = screen_param(0, 1) - 1;
+    screen.col = screen_param(1, 1) - 1;
+    break;
+  case 'A':
+    screen.row -= n;
+    break;
+  case 'B':
+    screen.row += n;
+    break;
+  case 'C':
+    screen.col += n;
+    break;
+  case 'D':
+    screen.col -= n;
+    break;
+  case 'G':
+    screen.col = n - 1;
+    break;
+  case 'd':
+    screen.row = n - 1;
+    break;
+  case 'J':
+    for (int r = 0; r < SCREEN_ROWS; r++) {
+      if ((mode == 0 && r > screen.row) || (mode == 1 && r < screen.row) || mode >= 2)
+	screen_clear(r, 0, SCREEN_COLS);
+    }
+    if (mode == 0)
+      screen_clear(screen.row, clamp(screen.col, 0, SCREEN_COLS), SCREEN_COLS);
+    else if (mode == 1)
+      screen_clear(screen.row, 0, clamp(screen.col + 1, 0, SCREEN_COLS));
+    break;
+  case 'K':
+    if (mode == 0)
+      screen_clear(screen.row, clamp(screen.col, 0, SCREEN_COLS), SCREEN_COLS);
+    else if (mode == 1)
+      screen_clear(screen.row, 0, clamp(screen.col + 1, 0, SCREEN_COLS));
+    else
+      screen_clear(screen.row, 0, SCREEN_COLS);
+    break;
+  }
+  screen.row = clamp(screen.row, 0, SCREEN_ROWS - 1);
+  screen.col = clamp(screen.col, 0, SCREEN_COLS - 1);
+}
+
+void screen_feed(const char* buf, int len)
+{
+  for (int i = 0; i < len; i++) {
+    unsigned char c = buf[i];
+    switch (screen.state) {
+    case VT_ESC:
+      if (c == '[') {
+	screen.state = VT_CSI;
+	screen.nparams = 0;
+	memset(screen.params, 0, sizeof(screen.params));
+      }
+      else
+	screen.state = c == ']' ? VT_OSC : VT_GROUND;
+      continue;
+    case VT_CSI:
+      if (c >= '0' && c <= '9') {
+	if (screen.nparams == 0)
+	  screen.nparams = 1;
+	if (screen.nparams <= SCREEN_PARAMS)
+	  screen.params[screen.nparams-1] = screen.params[screen.nparams-1] * 10 + (c - '0');
+      }
+      else if (c == ';')
+	screen.nparams++;
+      else if (c >= 0x40 && c <= 0x7e) {
+	screen_csi(c);
+	screen.state = VT_GROUND;
+      }
+      continue;
+    case VT_OSC:
+      // Window titles and the like end with BEL or ESC
+      if (c == 7 || c == 27)
+	screen.state = c == 27 ? VT_ESC : VT_GROUND;
+      continue;
+    }
+
+    switch (c) {
+    case 27:
+      screen.state = VT_ESC;
+      break;
+    case 13:
+      screen.col = 0;
+      break;
+    case 10:
+      // The shell's <LF> is a <CR><LF> on the client, as in the relay
+      screen.col = 0;
+      screen_newline();
+      break;
+    case 8:
+      if (screen.col > 0)
+	screen.col--;
+      break;
+    case 9:
+      screen.col = clamp((screen.col / 8 + 1) * 8, 0, SCREEN_COLS - 1);
+      break;
+    default:
+      if (c < 32 || c == 127)
+	break;
+      if (screen.col == SCREEN_COLS) {
+	screen.col = 0;
+	screen_newline();
+      }
+      screen.cells[screen.row][screen.col++] = c < 128 ? c : '?';
+      break;
+    }
+  }
+  screen_dirty = true;
+}
+
+void screen_init(int fps)
+{
+  screen_mode = true;
+  screen_fps = fps;
+  memset(screen.cells, ' ', sizeof(screen.cells));
+  if (clock_gettime(CLOCK_MONOTONIC, &screen_last) == -1)
+    error_and_exit("clock_gettime() failed", strerror(errno), __LINE__);
+}
+
+// A frame may go out once the last one has and the frame interval is up
+bool screen_due()
+{
+  if (screen_dirty == false || outq_len > 0)
+    return false;
+  struct timespec now;
+  if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+    error_and_exit("clock_gettime() failed", strerror(errno), __LINE__);
+  long long elapsed = 1000000000LL * (now.tv_sec - screen_last.tv_sec) +
+    (now.tv_nsec - screen_last.tv_nsec);
+  return elapsed >= 1000000000LL / screen_fps;
+}
+
+// Queue the rows that changed since the last frame
+void screen_flush()
+{
+  struct buffer* raw = pool_get();
+  if (screen_started == false) {
+    raw->len += sprintf(raw->data + raw->len, "\x1b[H\x1b[2J");
+    memset(sent_cells, ' ', sizeof(sent_cells));
+    screen_started = true;
+  }
+  for (int r = 0; r < SCREEN_ROWS; r++) {
+    int first = 0, last = SCREEN_COLS - 1;
+    while (first < SCREEN_COLS && screen.cells[r][first] == sent_cells[r][first])
+      first++;
+    if (first == SCREEN_COLS)
+      continue;
+    while (screen.cells[r][last] == sent_cells[r][last])
+      last--;
+    raw->len += sprintf(raw->data + raw->len, "\x1b[%d;%dH", r + 1, first + 1);
+    memcpy(raw->data + raw->len, screen.cells[r] + first, last - first + 1);
+    raw->len += last - first + 1;
+    memcpy(sent_cells[r] + first, screen.cells[r] + first, last - first + 1);
+  }
+  raw->len += sprintf(raw->data + raw->len, "\x1b[%d;%dH", screen.row + 1,
+		      clamp(screen.col, 0, SCREEN_COLS - 1) + 1);
+
+  if (framed == true) {
+    queue_output(raw);
+    pool_put(raw);
+  }
+  else
+    outq_push(raw, false);
+  screen_dirty = false;
+  if (clock_gettime(CLOCK_MONOTONIC, &screen_last) == -1)
+    error_and_exit("clock_gettime() failed", strerror(errno), __LINE__);
+}
+
+void handle_control(int control, bool sigpipe)
+{
+  if (control == FRAME_INTR) {
+    if (debug == true)
+      fprintf(stderr, "Interrupt: dropping %d queued frames\xD\xA", outq_len);
+    if (sigpipe == false && kill(child_pid, SIGINT) == -1) {
+      int errsv = errno;
+      char msg[200];
+      sprintf(msg, "sending SIGINT to process %d: kill() failed", child_pid);
+      error_and_exit(msg, strerror(errsv), __LINE__);
+    }
+    // A frame already partly sent has to be finished
+    int keep = outq_sent > 0 ? 1 : 0;
+    while (outq_len > keep) {
+      outq_len--;
+      pool_put(outq[(outq_head + outq_len) % OUTQ_FRAMES]);
+    }
+    discard_in_flight = in_flight;
+    queue_control(FRAME_FLUSH);
+    // Dropped screen frames leave the client out of step; redraw it all
+    if (screen_mode == true) {
+      screen_started = false;
+      screen_dirty = true;
+    }
+  }
+  else if (control == FRAME_EOF) {
+    if (debug == true)
+      fprintf(stderr, "Closing pipe to shell (line %d)\xD\xA", __LINE__);
+    if (sigpipe == false && close(pipefd_to_bash[1]) == -1) {
+      int errsv = errno;
+      char msg[200];
+      sprintf(msg, "could not close pipefd_to_bash[1]: close(%d) failed", pipefd_to_bash[1]);
+      error_and_exit(msg, strerror(errsv), __LINE__);
+    }
+  }
+  else
+    error_and_exit("invalid frame from client", "unknown control frame", __LINE__);
+}
+
+/*
+ * Echo received keystrokes back to the client (--echo), the way a terminal
+ * line discipline would: printable characters as they are, <CR> and <LF> as
+ * <LF> (the client maps it to <CR><LF>), <DEL> as an erase, and other control
+ * characters not at all.  The echo goes out ahead of whatever the shell
+ * prints in response, through the same path as shell output.  Erases take
+ * three bytes each, so a full frame of input can echo as several frames.
+ */
+bool echo;
+
+// Wait for the compression thread or the client until the pipeline and,
+// with --priority, the output queue have room for one more frame
+void output_wait()
+{
+  while ((pipeline == true && in_flight >= PIPELINE_SLOTS) ||
+	 (priority == true && in_flight >= outq_room())) {
+    if (in_flight > 0)
+      pipeline_collect();
+    else
+      outq_wait();
+  }
+}
+
+void echo_input(const char* buf, int len, struct buffer** raw, struct buffer* frame)
+{
+  for (int i = 0; i < len; ) {
+    int count = 0;
+    for (; i < len && count + 3 <= FRAME_SIZE; i++) {
+      if (buf[i] == 13 || buf[i] == 10)
+	(*raw)->data[count++] = '\xA';
+      else if (buf[i] == 127) {
+	memcpy((*raw)->data + count, "\b \b", 3);
+	count += 3;
+      }
+      else if (buf[i] >= 32 && buf[i] < 127)
+	(*raw)->data[count++] = buf[i];
+    }
+    (*raw)->len = count;
+    if (count == 0)
+      continue;
+
+    if (screen_mode == true)
+      screen_feed((*raw)->data, count);
+    else if (framed == false)
+      write_all(client_sockfd, (*raw)->data, count);
+    else {
+      output_wait();
+      if (pipeline == true)
+	pipeline_submit(raw);
+      else if (priority == true)
+	queue_output(*raw);
+      else
+	compress_input_and_write(*raw, frame);
+    }
+  }
+}
+
 void process_input(bool sigpipe)
 {
-  struct pollfd fds[2];
+  struct pollfd fds[3];
     
   // Set socket poll
   fds[0].fd = client_sockfd;
@@ -236,36 +884,73 @@ void process_input(bool sigpipe)
   fds[1].fd = pipefd_to_term[0];
   fds[1].events = POLLIN;
 
+  // Set compression pipeline poll
+  fds[2].fd = pipeline == true ? wake_io[0] : -1;
+  fds[2].events = POLLIN;
+  fds[2].revents = 0;
+
   // Read input
   const int SIZE = 256;
-  char buf[256];
+  char buf[FRAME_SIZE];
   
-  // Set up buffers for compression
-  char compress_in[SIZE], compress_out[SIZE];
+  // Set up buffers for compression; raw output is at most 2*SIZE after
+  // <LF> mapping, and an inflated frame from the client fits in FRAME_SIZE
+  struct buffer* raw = pool_get();
+  struct buffer* frame = pool_get();
+  struct buffer* plain = pool_get();
 
   while(1) {
-    int c = poll(fds,2,0);
+    // Stop reading the shell while every pipeline slot is busy or, with
+    // --priority, the output queue has no room for what is in flight
+    bool shell_ready = in_flight < PIPELINE_SLOTS;
+    if (priority == true)
+      shell_ready = shell_ready && in_flight < outq_room();
+    fds[1].fd = shell_ready ? pipefd_to_term[0] : -1;
+    if (screen_mode == true && screen_due())
+      screen_flush();
+    fds[0].events = outq_len > 0 ? POLLIN|POLLOUT : POLLIN;
+    int c = poll(fds,3,0);
     int errsv = errno;
     if (c < 0) {
       error_and_exit("poll() failed", strerror(errsv), __LINE__);
     }
-    else if (sigpipe == true && c == 0) {
+    else if (sigpipe == true && c == 0 && in_flight == 0) {
       if (debug == true)
 	fprintf(stderr, "sigpipe and exit (line %d)\xD\xA", __LINE__);
       goto end;
     }
     else if (c > 0) {
+      // Send out queued frames the socket has room for
+      if ((fds[0].revents & POLLOUT) != 0) {
+	outq_send();
+	fds[0].revents &= ~POLLOUT;
+      }
+
+      // Send out anything the compression thread has finished
+      if (fds[2].revents != 0) {
+	pipeline_collect();
+	fds[2].revents = 0;
+      }
+      if (fds[0].revents == 0 && fds[1].revents == 0)
+	continue;
+
       // Check which poll succeeded
       int bytes_read;
+      int control = 0;
       if ((fds[0].revents & POLLIN) != 0) {
-	bytes_read = read(client_sockfd, buf, SIZE);
+	if (framed == true)
+	  bytes_read = read_frame(client_sockfd, frame, &control);
+	else
+	  bytes_read = read(client_sockfd, buf, SIZE);
+	// The shell is serviced on the next pass; the relay below keys off revents
+	fds[1].revents = 0;
 	if (debug == true) {
 	  fprintf(stderr, "Received input from keyboard! (line %d)\xD\xA", __LINE__);
 	  fprintf(stderr, "%d %d\xD\xA", fds[0].revents, fds[1].revents);
 	}
       }
       else if ((fds[1].revents & POLLIN) != 0) {
-	//fds[0].revents = 0;
+	fds[0].revents = 0;
 	bytes_read = read(pipefd_to_term[0], buf, SIZE);
 	if (debug == true)
 	  fprintf(stderr, "Received input from shell! (line %d)\xD\xA", __LINE__);
@@ -292,143 +977,86 @@ void process_input(bool sigpipe)
 	goto end;
       }
 
-      // Decompress received input if necessary
-      if (fds[0].revents != 0 &&  fds[1].revents == 0 && _compress == true) {
-	int ret = inf(buf, compress_out, bytes_read);
-	if (ret != Z_OK) {
-	  zerr(ret);
-	  exit(1);
+      // Control frames skip the byte relay entirely
+      if (control != 0) {
+	handle_control(control, sigpipe);
+	continue;
+      }
+
+      // In screen mode shell output only updates the model
+      if (screen_mode == true && fds[1].revents != 0) {
+	screen_feed(buf, bytes_read);
+	continue;
+      }
+
+      // Unpack (and decompress) a received frame if necessary
+      if (fds[0].revents != 0 &&  fds[1].revents == 0 && framed == true) {
+	plain->len = 0;
+	if (_compress == true) {
+	  int ret = inf(frame->data, frame->len, plain);
+	  if (ret != Z_OK) {
+	    zerr(ret);
+	    exit(1);
+	  }
+	}
+	else {
+	  memcpy(plain->data, frame->data, frame->len);
+	  plain->len = frame->len;
 	}
-	strcpy(buf, compress_out);
-	bytes_read = strlen(buf);
+	if (plain->len > FRAME_SIZE)
+	  error_and_exit("invalid frame from client", "frame too large", __LINE__);
+	memcpy(buf, plain->data, plain->len);
+	bytes_read = plain->len;
       }
       if (debug == true) {
-	fprintf(stderr, "buf is now: %s\xD\xA", buf);
+	fprintf(stderr, "buf is now: %.*s\xD\xA", bytes_read, buf);
 	fprintf(stderr, "bytes_read is: %d\xD\xA", bytes_read);
-	fprintf(stderr, "length of buf is: %d\xD\xA", (int)strlen(buf));
       }
+      if (echo == true && fds[0].revents != 0 && sigpipe == false)
+	echo_input(buf, bytes_read, &raw, frame);
 
-      // Write buffer
-      int count = 0;
-      for (int i = 0; i < bytes_read; i++) {
-	switch(*(buf+i)) {
-	case 3:
-	  if (sigpipe == false && kill(child_pid, SIGINT) == -1) {
-	    if (debug == true)
-	      fprintf(stderr, "Killing shell...\xD\xA");
-	    int errsv = errno;
-	    char msg[200];
-	    sprintf(msg, "sending SIGINT to process %d: kill() failed", child_pid);
-	    error_and_exit(msg, strerror(errsv), __LINE__);
-	  }
-	  break;
-	case 4:
-	  // Close pipe to shell
+      // Pass keyboard input on to the shell up to each ^C or ^D
+      if (fds[0].revents != 0) {
+	for (int i = 0; i < bytes_read; ) {
+	  int n = relay_to_shell(buf + i, bytes_read - i, plain->data);
 	  if (debug == true)
-	    fprintf(stderr, "Closing pipe to shell (line %d)\xD\xA", __LINE__);
-	  if (fds[0].revents != 0 && close(pipefd_to_bash[1]) == -1) {
+	    fprintf(stderr, "Write to shell: %.*s\xD\xA", n, plain->data);
+	  if (sigpipe == false)
+	    relay_write(pipefd_to_bash[1], plain->data, n);
+	  i += n;
+	  if (i == bytes_read)
+	    break;
+	  if (buf[i] == RELAY_INTR && sigpipe == false && kill(child_pid, SIGINT) == -1) {
 	    int errsv = errno;
 	    char msg[200];
-	    sprintf(msg, "could not close pipefd_to_bash[1]: close(%d) failed", pipefd_to_bash[1]);
+	    sprintf(msg, "sending SIGINT to process %d: kill() failed", child_pid);
 	    error_and_exit(msg, strerror(errsv), __LINE__);
 	  }
-	  break;
-
-	case 13:
-	  // Receive <CR> from stdin, map to <CR><LF> for stdout, <LF> for bash
-	  // EDIT: Receive <CR> from socket, map to <LF> for bash
-	  if (fds[0].revents != 0 && fds[1].revents == 0) {
-	    /*
-	    if (write(1, "\xD\xA", 2) == -1) {
-	      error_and_exit("could not write to stdout: write(1) failed", \
-			     strerror(errno), __LINE__);
-	    }
-	    */
-	    if (sigpipe == false && write(pipefd_to_bash[1], "\xA", 1) == -1) {
-	      int errsv = errno;
-	      char msg[200];
-	      sprintf(msg, "could not write to pipefd_to_bash[1]: "
-		      "write(%d) failed", pipefd_to_bash[1]);
-	      error_and_exit(msg, strerror(errsv), __LINE__);
-	    }
-	  }
-	  // Receive <CR> from shell, write to socket unmodified
-	  else if (fds[1].revents != 0) {
-	    if (_compress == false && write(client_sockfd, buf+i, 1) == -1)
-	      error_and_exit("could not write to socket: write() failed", \
-			     strerror(errno), __LINE__);
-	    else if (_compress == true) {
-	      compress_in[count] = *(buf+i);
-	      count++;
-	    }
-	  }
-	  break;
-
-	case 10:
-	  // Receive <LF> from keyboard, map to <CR><LF> for stdout, <LF> for bash
-	  // EDIT: Receive <LF> from socket, write to bash unmodified
-	  if (fds[0].revents != 0 && fds[1].revents == 0) {
-	    /*
-	    if (write(1, "\xD\xA", 2) == -1) {
-	      error_and_exit("could not write to stdout: write(1) failed", \
-			     strerror(errno), __LINE__);
-	    }
-	    */
-	    if (sigpipe == false && write(pipefd_to_bash[1], buf+i, 1) == -1) {
-	      int errsv = errno;
-	      char msg[200];
-	      sprintf(msg, "could not write to pipefd_to_bash[1]: "
-		      "write(%d) failed", pipefd_to_bash[1]);
-	      error_and_exit(msg, strerror(errsv), __LINE__);
-	    }
-	  }
-	  // Receive <LF> from shell, map to <CR><LF> for socket
-	  else if (fds[1].revents != 0) {
-	    if (_compress == false && write(client_sockfd, "\xD\xA", 2) == -1)
-	      error_and_exit("could not write to socket: write() failed", \
-			     strerror(errno), __LINE__);
-	    else if (_compress == true) {
-	      compress_in[count] = '\xD';
-	      compress_in[count+1] = '\xA';
-	      count += 2;
-	    }
-	  }
-	  break;
-
-	default:
-	  /*
-	  if (write(1, buf+i, 1) == -1)
-	    error_and_exit("could not write to stdout: write(1) failed", \
-			   strerror(errno), __LINE__);
-	  */
-	  // Process input from socket
-	  if (fds[0].revents != 0 && fds[1].revents == 0) {
+	  else if (buf[i] == RELAY_EOF) {
+	    // Close pipe to shell
 	    if (debug == true)
-	      fprintf(stderr, "Write to shell: %c\xD\xA", *(buf+i));
-	    if (sigpipe == false && write(pipefd_to_bash[1], buf+i, 1) == -1) {
+	      fprintf(stderr, "Closing pipe to shell (line %d)\xD\xA", __LINE__);
+	    if (close(pipefd_to_bash[1]) == -1) {
 	      int errsv = errno;
 	      char msg[200];
-	      sprintf(msg, "could not write to pipefd_to_bash[1]: "
-		      "write(%d) failed", pipefd_to_bash[1]);
+	      sprintf(msg, "could not close pipefd_to_bash[1]: close(%d) failed", pipefd_to_bash[1]);
 	      error_and_exit(msg, strerror(errsv), __LINE__);
 	    }
 	  }
-	  // Process input from shell
-	  else if (fds[1].revents != 0) {
-	    if (_compress == false && write(client_sockfd, buf+i, 1) == -1) {
-	      error_and_exit("could not write to socket: write() failed", strerror(errno), __LINE__);
-	    }
-	    else if (_compress == true) {
-	      compress_in[count] = *(buf+i);
-	      count++;
-	    }
-	  }
-	  break;
+	  i++;
 	}
       }
-      // Compress input if needed
-      if (_compress == true && fds[1].revents != 0) {
-	compress_input_and_write(compress_in, compress_out, count);
+      // Map the shell's <LF> to <CR><LF>, then compress or queue if needed
+      else {
+	raw->len = relay_to_term(buf, bytes_read, raw->data, false);
+	if (framed == false)
+	  write_all(client_sockfd, raw->data, raw->len);
+	else if (pipeline == true)
+	  pipeline_submit(&raw);
+	else if (priority == true)
+	  queue_output(raw);
+	else
+	  compress_input_and_write(raw, frame);
       }
     }
     // Reset revents
@@ -440,6 +1068,14 @@ void process_input(bool sigpipe)
     */
   }
  end:;
+  if (pipeline == true)
+    pipeline_drain();
+  if (screen_mode == true && screen_dirty == true)
+    screen_flush();
+  outq_drain();
+  pool_put(raw);
+  pool_put(frame);
+  pool_put(plain);
   if (debug == true)
     fprintf(stderr, "Reached end of process_input() (line %d)\xD\xA", __LINE__);
 }
@@ -455,153 +1091,435 @@ void catch_sigpipe()
   exit(SHELL_STATUS);
 }
 
-void replace_child_fds()
+int execute_with_shell()
 {
-  // Replace stdin with pipe from terminal process
-  if (close(0) == -1) {
-    write(pipefd_to_term[1], "\x4", 1); // This is redundant
-    error_and_exit("could not close stdin: close(0) failed", strerror(errno), __LINE__);
-  }
-  if (dup2(pipefd_to_bash[0], 0) == -1) {
-    write(pipefd_to_term[1], "\x4", 1); // This is redundant
-    fprintf(stderr, "ERROR: could not duplicate pipefd_to_bash[0]: dup2(%d,%d) "
-	    "failed at line %d: %s\xD\xA", pipefd_to_bash[0], 0, __LINE__, strerror(errno));
-    exit(1);
+  // Save to global variable
+  child_pid = relay_start_shell(pipefd_to_bash, pipefd_to_term);
+
+  // Implement signal handler for SIGPIPE
+  signal(SIGPIPE, catch_sigpipe);
+
+  if (pipeline == true)
+    pipeline_start();
+
+  // Process input
+  process_input(false);
+  if (pipeline == true)
+    pipeline_stop();
+  if (debug == true)
+    fprintf(stderr, "Finished processing input (line %d)\xD\xA", __LINE__);
+
+  const int SHELL_STATUS = print_exit_status();
+  return SHELL_STATUS;
+}
+
+/*
+ * Channel multiplexing (--mux)
+ *
+ * Every message on the connection is a frame: a 4-byte header holding the
+ * frame type, the channel ID and a 16-bit payload length (network order),
+ * followed by the payload.  Each channel runs its own shell.  Output is sent
+ * raw (no <LF> mapping) and flow control is per channel: a side may only have
+ * MUX_WINDOW payload bytes outstanding on a channel until the peer grants
+ * more with a MUX_WINDOW_UPDATE frame.
+ */
+#define MUX_HEADER 4
+#define MUX_MAX_CHANNELS 32
+#define MUX_WINDOW 16384
+#define MUX_READ_SIZE FRAME_SIZE
+#define MUX_MAX_PAYLOAD CHUNK
+
+enum {
+  MUX_OPEN = 1,       // client -> server: start a shell on the channel
+  MUX_DATA,           // either way: channel bytes (deflated with --compress)
+  MUX_EOF,            // client -> server: close the shell's stdin
+  MUX_SIGNAL,         // client -> server: 1-byte signal number for the shell
+                      // (SIGINT, SIGTERM, SIGHUP or SIGQUIT; others are ignored)
+  MUX_WINDOW_UPDATE,  // either way: 4-byte credit grant for the channel
+  MUX_CLOSE           // server -> client: shell exited, 1-byte exit status
+};
+
+struct channel {
+  bool open;
+  pid_t pid;
+  int to_shell, from_shell;   // -1 once closed
+  int send_window;            // output bytes we may still send to the client
+  char pending[MUX_WINDOW];   // client input not yet taken by the shell
+  int pending_len;
+  int consumed;               // input written to the shell since the last grant
+  bool eof_requested;
+};
+
+struct channel channels[MUX_MAX_CHANNELS];
+int child_pipe[2];  // SIGCHLD wakes poll() through this
+
+void catch_sigchld()
+{
+  int saved_errno = errno;
+  if (write(child_pipe[1], "", 1) == -1) {
+    // Full pipe: a wakeup is already pending
   }
-  if (close(pipefd_to_bash[0]) == -1) {
-    write(pipefd_to_term[1], "\x4", 1); // This is redundant
-    fprintf(stderr, "ERROR: could not close pipefd_to_bash[0]: close(%d) "
-	    "failed at line %d: %s\xD\xA", pipefd_to_bash[0], __LINE__, strerror(errno));      
-    exit(1);
+  errno = saved_errno;
+}
+
+void mux_send(int type, int ch, const char* payload, int len)
+{
+  char frame[MUX_HEADER + MUX_MAX_PAYLOAD];
+  frame[0] = type;
+  frame[1] = ch;
+  frame[2] = (len >> 8) & 0xff;
+  frame[3] = len & 0xff;
+  memcpy(frame + MUX_HEADER, payload, len);
+  write_all(client_sockfd, frame, MUX_HEADER + len);
+}
+
+void mux_send_window(int ch, int credit)
+{
+  char payload[4] = {(credit >> 24) & 0xff, (credit >> 16) & 0xff,
+		     (credit >> 8) & 0xff, credit & 0xff};
+  mux_send(MUX_WINDOW_UPDATE, ch, payload, 4);
+}
+
+void mux_open(int ch)
+{
+  struct channel* chan = channels + ch;
+  // The channel is already running; closing it would drop a live shell
+  if (chan->open) {
+    if (debug == true)
+      fprintf(stderr, "Ignoring open for open channel %d\xD\xA", ch);
+    return;
   }
-  if (close(pipefd_to_bash[1]) == -1) {
-    // Note: switching fprintf and write causes terminal not to output properly?
-    fprintf(stderr, "ERROR: could not close pipefd_to_bash[1]: close(%d) "
-	    "failed at line %d: %s\xD\xA", pipefd_to_bash[1], __LINE__, strerror(errno));
-    write(pipefd_to_term[1], "\x4", 1); // This is redundant
+
+  if (pipe(pipefd_to_bash) == -1)
+    error_and_exit("unable to initialize pipefd_to_bash: pipe() failed", strerror(errno), __LINE__);
+  if (pipe(pipefd_to_term) == -1)
+    error_and_exit("unable to initialize pipefd_to_term: pipe() failed", strerror(errno), __LINE__);
+
+  pid_t pid = fork();
+  if (pid == -1)
+    error_and_exit("fork() failed", strerror(errno), __LINE__);
+
+  if (pid == 0) {
+    // Drop the connection and every other channel's pipes
+    close(client_sockfd);
+    close(child_pipe[0]);
+    close(child_pipe[1]);
+    for (int i = 0; i < MUX_MAX_CHANNELS; i++) {
+      if (channels[i].open && channels[i].to_shell != -1)
+	close(channels[i].to_shell);
+      if (channels[i].open && channels[i].from_shell != -1)
+	close(channels[i].from_shell);
+    }
+    signal(SIGPIPE, SIG_DFL);
+    relay_replace_child_fds(pipefd_to_bash, pipefd_to_term);
+
+    const char* path = "/bin/bash";
+    if (execl(path, path, (char*)NULL) == -1)
+      error_and_exit_child("exec(\"/bin/bash\") failed", strerror(errno), 1, __LINE__);
     exit(1);
   }
 
-  // Replace stdout and stderror with pipe to terminal process
-  if (close(1) == -1) {
-    error_and_exit_child("could not close stdout: "
-			 "close(1) failed", strerror(errno), pipefd_to_term[1], __LINE__);
+  if (close(pipefd_to_bash[0]) == -1 || close(pipefd_to_term[1]) == -1)
+    error_and_exit("could not close pipe to shell: close() failed", strerror(errno), __LINE__);
+  if (fcntl(pipefd_to_bash[1], F_SETFL, O_NONBLOCK) == -1)
+    error_and_exit("could not set pipe to shell non-blocking: fcntl() failed", strerror(errno), __LINE__);
+
+  chan->open = true;
+  chan->pid = pid;
+  chan->to_shell = pipefd_to_bash[1];
+  chan->from_shell = pipefd_to_term[0];
+  chan->send_window = MUX_WINDOW;
+  chan->pending_len = 0;
+  chan->consumed = 0;
+  chan->eof_requested = false;
+  if (debug == true)
+    fprintf(stderr, "Opened channel %d (pid %d)\xD\xA", ch, pid);
+}
+
+void mux_close_input(struct channel* chan)
+{
+  if (chan->to_shell != -1 && close(chan->to_shell) == -1)
+    error_and_exit("could not close pipe to shell: close() failed", strerror(errno), __LINE__);
+  chan->to_shell = -1;
+}
+
+void mux_flush_input(int ch)
+{
+  struct channel* chan = channels + ch;
+  while (chan->pending_len > 0) {
+    int n = write(chan->to_shell, chan->pending, chan->pending_len);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+      break;
+    if (n == -1) {
+      // Shell stopped reading; discard its input, output still drains
+      chan->pending_len = 0;
+      mux_close_input(chan);
+      return;
+    }
+    memmove(chan->pending, chan->pending + n, chan->pending_len - n);
+    chan->pending_len -= n;
+    chan->consumed += n;
   }
-    
-  if (dup2(pipefd_to_term[1], 1) == -1) {
-    int errsv = errno;
-    char msg[200];
-    sprintf(msg, "could not duplicate pipefd_to_term[1]: dup2(%d,1) failed", pipefd_to_term[1]);
-    error_and_exit_child(msg, strerror(errsv), pipefd_to_term[1], __LINE__);
+  if (chan->consumed >= MUX_WINDOW / 2) {
+    mux_send_window(ch, chan->consumed);
+    chan->consumed = 0;
+  }
+  if (chan->eof_requested && chan->pending_len == 0)
+    mux_close_input(chan);
+}
+
+// Reap a channel whose output has closed, without waiting, and tell the
+// client.  A shell can close its output and keep running (exec >&-); it is
+// reaped on a later SIGCHLD rather than holding up the other channels.
+void mux_reap(int ch)
+{
+  struct channel* chan = channels + ch;
+  int wstatus = 0;
+  pid_t pid = waitpid(chan->pid, &wstatus, WNOHANG);
+  if (pid == -1)
+    error_and_exit("waitpid() failed", strerror(errno), __LINE__);
+  if (pid == 0)
+    return;
+  char status = (wstatus & 0xff00) >> 8;
+  mux_send(MUX_CLOSE, ch, &status, 1);
+  chan->open = false;
+  if (debug == true)
+    fprintf(stderr, "Closed channel %d\xD\xA", ch);
+}
+
+void mux_relay_output(int ch)
+{
+  struct channel* chan = channels + ch;
+  char buf[MUX_READ_SIZE];
+  int size = chan->send_window < MUX_READ_SIZE ? chan->send_window : MUX_READ_SIZE;
+  int bytes_read = read(chan->from_shell, buf, size);
+  if (bytes_read < 0)
+    error_and_exit("could not read from shell: read() failed", strerror(errno), __LINE__);
+
+  if (bytes_read == 0) {
+    // Shell closed its output; close the channel once it has exited
+    close(chan->from_shell);
+    chan->from_shell = -1;
+    mux_close_input(chan);
+    mux_reap(ch);
+    return;
   }
 
-  // Save stderr before closing
-  int d = dup(2);
-  int errsv = errno;
-  if (d == -1) {
-    error_and_exit_child("could not duplicate stderr: "
-			 "dup(2) failed", strerror(errsv), pipefd_to_term[1], __LINE__);
+  chan->send_window -= bytes_read;
+  if (_compress == true) {
+    struct buffer* out = pool_get();
+    int ret = def(buf, bytes_read, out, Z_DEFAULT_COMPRESSION);
+    if (ret != Z_OK) {
+      zerr(ret);
+      exit(1);
+    }
+    mux_send(MUX_DATA, ch, out->data, out->len);
+    pool_put(out);
   }
-    
-  if (close(2) == -1) {
-    error_and_exit_child("could not close stderr: "
-			 "close(2) failed", strerror(errno), pipefd_to_term[1], __LINE__);
+  else
+    mux_send(MUX_DATA, ch, buf, bytes_read);
+}
+
+void mux_process_frame(int type, int ch, char* payload, int len)
+{
+  if (ch >= MUX_MAX_CHANNELS)
+    error_and_exit("invalid frame from client", "bad channel", __LINE__);
+  struct channel* chan = channels + ch;
+  if (type != MUX_OPEN && chan->open == false) {
+    if (debug == true)
+      fprintf(stderr, "Frame %d for closed channel %d\xD\xA", type, ch);
+    return;
   }
 
-  if(dup2(pipefd_to_term[1], 2) == -1) {
-    int errsv = errno;
-    dup2(d,2); // Restore stderr so that we can print error message
-    char msg[200];
-    sprintf(msg, "could not duplicate pipefd_to_term[1]: dup2(%d,2) failed", pipefd_to_term[1]);
-    error_and_exit_child(msg, strerror(errsv), pipefd_to_term[1], __LINE__);
+  switch (type) {
+  case MUX_OPEN:
+    mux_open(ch);
+    break;
+  case MUX_DATA: {
+    struct buffer* plain = pool_get();
+    if (_compress == true) {
+      int ret = inf(payload, len, plain);
+      if (ret != Z_OK) {
+	zerr(ret);
+	exit(1);
+      }
+      payload = plain->data;
+      len = plain->len;
+    }
+    if (chan->to_shell != -1) {
+      if (chan->pending_len + len > MUX_WINDOW)
+	error_and_exit("invalid frame from client", "channel window exceeded", __LINE__);
+      memcpy(chan->pending + chan->pending_len, payload, len);
+      chan->pending_len += len;
+      mux_flush_input(ch);
+    }
+    pool_put(plain);
+    break;
   }
-    
-  if(close(pipefd_to_term[0]) == -1) {
-    int errsv = errno;
-    dup2(d,2);
-    char msg[200];
-    sprintf(msg, "could not close pipefd_to_term[0]: close(%d) failed", pipefd_to_term[0]);
-    error_and_exit_child(msg, strerror(errsv), pipefd_to_term[1], __LINE__);
+  case MUX_EOF:
+    chan->eof_requested = true;
+    if (chan->pending_len == 0)
+      mux_close_input(chan);
+    break;
+  case MUX_SIGNAL: {
+    // Only the signals a terminal could send; anything else from the client
+    // is ignored rather than allowed to take down every channel
+    int sig = len == 1 ? payload[0] : 0;
+    if (sig != SIGINT && sig != SIGTERM && sig != SIGHUP && sig != SIGQUIT) {
+      if (debug == true)
+	fprintf(stderr, "Ignoring signal %d for channel %d\xD\xA", sig, ch);
+      break;
+    }
+    // The shell may have exited without its output closing yet
+    if (kill(chan->pid, sig) == -1 && errno != ESRCH)
+      error_and_exit("kill() failed", strerror(errno), __LINE__);
+    break;
   }
-    
-  if(close(pipefd_to_term[1]) == -1) {
-    int errsv = errno;
-    dup2(d,2);
-    char msg[200];
-    sprintf(msg, "could not close pipefd_to_term[1]: close(%d) failed", pipefd_to_term[1]);
-    error_and_exit_child(msg, strerror(errsv), 2, __LINE__); // Why only work properly w/ fd 1?
+  case MUX_WINDOW_UPDATE:
+    if (len == 4)
+      chan->send_window += ((payload[0] & 0xff) << 24) | ((payload[1] & 0xff) << 16) |
+	((payload[2] & 0xff) << 8) | (payload[3] & 0xff);
+    break;
+  default:
+    error_and_exit("invalid frame from client", "unknown frame type", __LINE__);
   }
 }
 
-int execute_with_shell()
+int process_mux()
 {
-  // Implement pipes
-  if (pipe(pipefd_to_bash) == -1) {
-    error_and_exit("unable to initialize pipefd_to_bash: pipe() failed", strerror(errno), __LINE__);
-  }
-  if (pipe(pipefd_to_term) == -1) {
-    error_and_exit("unable to initialize pipefd_to_term: pipe() failed", strerror(errno), __LINE__);
-  }
+  // Closed shells are handled through EPIPE instead of catch_sigpipe()
+  signal(SIGPIPE, SIG_IGN);
+  if (pipe(child_pipe) == -1)
+    error_and_exit("unable to initialize child_pipe: pipe() failed", strerror(errno), __LINE__);
+  if (fcntl(child_pipe[0], F_SETFL, O_NONBLOCK) == -1 ||
+      fcntl(child_pipe[1], F_SETFL, O_NONBLOCK) == -1)
+    error_and_exit("could not set child_pipe non-blocking: fcntl() failed", strerror(errno), __LINE__);
+  // sigaction(): under _POSIX_C_SOURCE, signal() resets the handler once it runs
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = catch_sigchld;
+  sa.sa_flags = SA_NOCLDSTOP;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGCHLD, &sa, NULL) == -1)
+    error_and_exit("sigaction() failed", strerror(errno), __LINE__);
 
-  // Fork process
-  pid_t pid = fork();
-  int errsv = errno;
-  if (pid == -1) {
-    error_and_exit("fork() failed", strerror(errsv), __LINE__);
-  }
+  char inbuf[MUX_HEADER + MUX_MAX_PAYLOAD];
+  int inlen = 0;
+  struct pollfd fds[2 + 2 * MUX_MAX_CHANNELS];
+  int fd_channel[2 + 2 * MUX_MAX_CHANNELS];
 
-  if (pid == 0) {
-    // Replace file descriptors
-    replace_child_fds();
+  while (1) {
+    int nfds = 2;
+    fds[0].fd = client_sockfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = child_pipe[0];
+    fds[1].events = POLLIN;
+    for (int i = 0; i < MUX_MAX_CHANNELS; i++) {
+      if (channels[i].open == false)
+	continue;
+      // Stop reading a shell whose window is used up
+      if (channels[i].from_shell != -1 && channels[i].send_window > 0) {
+	fds[nfds].fd = channels[i].from_shell;
+	fds[nfds].events = POLLIN;
+	fd_channel[nfds++] = i;
+      }
+      if (channels[i].to_shell != -1 && channels[i].pending_len > 0) {
+	fds[nfds].fd = channels[i].to_shell;
+	fds[nfds].events = POLLOUT;
+	fd_channel[nfds++] = i;
+      }
+    }
 
-    // Exec shell
-    const char* path = "/bin/bash";
-    if (execl(path, path, (char*)NULL) == -1)
-      error_and_exit_child("exec(\"/bin/bash\") failed", strerror(errno), pipefd_to_term[1], __LINE__);
-    exit(1);
-  }
-  else {
-    // Save to global variable
-    child_pid = pid;
+    if (poll(fds, nfds, -1) == -1) {
+      if (errno == EINTR)
+	continue;
+      error_and_exit("poll() failed", strerror(errno), __LINE__);
+    }
 
-    // Implement signal handler for SIGPIPE
-    signal(SIGPIPE, catch_sigpipe);
-    // kill(child_pid, SIGINT);
-    // kill(getpid(), SIGPIPE);
+    if (fds[0].revents != 0) {
+      int bytes_read = read(client_sockfd, inbuf + inlen, sizeof(inbuf) - inlen);
+      if (bytes_read < 0)
+	error_and_exit("could not read from socket: read() failed", strerror(errno), __LINE__);
+      if (bytes_read == 0)
+	break;
+      inlen += bytes_read;
 
-    // Close unused file descriptors
-    if (close(pipefd_to_bash[0]) == -1) {
-      int errsv = errno;
-      char msg[200];
-      sprintf(msg, "could not close pipefd_to_bash[0]: close(%d) failed", pipefd_to_bash[0]);
-      error_and_exit(msg, strerror(errsv), __LINE__);
+      // Handle every complete frame in the buffer
+      int offset = 0;
+      while (inlen - offset >= MUX_HEADER) {
+	int len = ((inbuf[offset+2] & 0xff) << 8) | (inbuf[offset+3] & 0xff);
+	if (len > MUX_MAX_PAYLOAD)
+	  error_and_exit("invalid frame from client", "payload too large", __LINE__);
+	if (inlen - offset < MUX_HEADER + len)
+	  break;
+	mux_process_frame(inbuf[offset] & 0xff, inbuf[offset+1] & 0xff,
+			  inbuf + offset + MUX_HEADER, len);
+	offset += MUX_HEADER + len;
+      }
+      memmove(inbuf, inbuf + offset, inlen - offset);
+      inlen -= offset;
     }
-    if (close(pipefd_to_term[1]) == -1) {
-      int errsv = errno;
-      char msg[200];
-      sprintf(msg, "could not close pipefd_to_term[1]: close(%d) failed", pipefd_to_term[1]);
-      error_and_exit(msg, strerror(errsv), __LINE__);
+
+    // A shell exited: close any channel that was only waiting for that
+    if (fds[1].revents != 0) {
+      char wakeup[64];
+      while (read(child_pipe[0], wakeup, sizeof(wakeup)) > 0)
+	;
+      for (int i = 0; i < MUX_MAX_CHANNELS; i++) {
+	if (channels[i].open && channels[i].from_shell == -1)
+	  mux_reap(i);
+      }
     }
-    
-    // Process input
-    process_input(false);
-    if (debug == true)
-      fprintf(stderr, "Finished processing input (line %d)\xD\xA", __LINE__);
 
-    const int SHELL_STATUS = print_exit_status();
-    //    free(buf);
-    return SHELL_STATUS;
+    for (int i = 2; i < nfds; i++) {
+      if (fds[i].revents == 0 || channels[fd_channel[i]].open == false)
+	continue;
+      if (fds[i].events == POLLOUT)
+	mux_flush_input(fd_channel[i]);
+      else
+	mux_relay_output(fd_channel[i]);
+    }
+  }
+
+  // Client went away: hang up every shell still running
+  if (debug == true)
+    fprintf(stderr, "Client closed connection\xD\xA");
+  for (int i = 0; i < MUX_MAX_CHANNELS; i++) {
+    if (channels[i].open == false)
+      continue;
+    kill(channels[i].pid, SIGHUP);
+    while (waitpid(channels[i].pid, NULL, 0) == -1 && errno == EINTR)
+      ;
   }
+  return 0;
+}
+
+// Fill in a Unix domain address; a leading '@' selects the abstract namespace
+socklen_t set_unix_addr(struct sockaddr_un* addr, const char* path)
+{
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  size_t len = strlen(path);
+  if (len == 0 || len >= sizeof(addr->sun_path)) {
+    fprintf(stderr, "Invalid socket path: %s\n", path);
+    exit(1);
+  }
+  memcpy(addr->sun_path, path, len);
+  if (path[0] == '@')
+    addr->sun_path[0] = '\0';
+  return offsetof(struct sockaddr_un, sun_path) + len;
 }
 
 int main(int argc, char* argv[])
 {
   // Setup argument processing
   if (argc < 2) {
-    fprintf(stderr, "Missing required option: --port\n");
+    fprintf(stderr, "Missing required option: --port or --unix\n");
     exit(1);
   }
   int port = 0;
+  char* unix_path = NULL;
+  bool mux = false;
   debug = false;
   _compress = false;
   int longindex;
@@ -609,6 +1527,12 @@ int main(int argc, char* argv[])
     {"port", required_argument, 0, 0},
     {"compress", no_argument, 0, 0},
     {"debug", no_argument, 0, 0},
+    {"unix", required_argument, 0, 0},
+    {"mux", no_argument, 0, 0},
+    {"compress-thread", no_argument, 0, 0},
+    {"priority", no_argument, 0, 0},
+    {"screen", optional_argument, 0, 0},
+    {"echo", no_argument, 0, 0},
     {0, 0, 0, 0}
   };
 
@@ -630,26 +1554,85 @@ int main(int argc, char* argv[])
       _compress = true;
     else if (longindex == 2)
       debug = true;
+    else if (longindex == 3)
+      unix_path = optarg;
+    else if (longindex == 4)
+      mux = true;
+    else if (longindex == 5)
+      pipeline = true;
+    else if (longindex == 6)
+      priority = true;
+    else if (longindex == 7) {
+      screen_fps = optarg != NULL ? atoi(optarg) : 10;
+      if (screen_fps <= 0) {
+	fprintf(stderr, "Invalid frame rate: %s\n", optarg);
+	exit(1);
+      }
+    }
+    else if (longindex == 8)
+      echo = true;
+  }
+
+  // Compression only costs CPU on a same-host link, so the client (which
+  // applies the same rule) and server both leave it off for Unix sockets
+  if (unix_path != NULL && _compress == true) {
+    if (debug == true)
+      fprintf(stderr, "Unix socket: compression disabled\n");
+    _compress = false;
   }
 
+  // The compression thread only serves the single-shell relay; screen
+  // frames are small and rate limited, so they are compressed inline
+  if (_compress == false || mux == true || screen_fps > 0)
+    pipeline = false;
+
+  // Mux frames carry their own control types
+  if (mux == true)
+    priority = false;
+  framed = _compress || priority;
+  if (screen_fps > 0 && mux == false)
+    screen_init(screen_fps);
+
   // Start code for socket
   int sockfd;
   {
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    sockfd = socket(unix_path != NULL ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
     int errsv = errno;
     if (sockfd == -1)
       error_and_exit("unable to create socket", strerror(errsv), __LINE__);
   }
 
-  struct sockaddr_in serv_addr;
-  memset(&serv_addr, 0, sizeof(serv_addr));
-  serv_addr.sin_family = AF_INET;
-  serv_addr.sin_addr.s_addr = INADDR_ANY;
-  serv_addr.sin_port = htons(port); // htons(portno)
+  if (unix_path != NULL) {
+    struct sockaddr_un serv_addr;
+    socklen_t addr_len = set_unix_addr(&serv_addr, unix_path);
 
-  // Bind address to socket
-  if(bind(sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) == -1)
-     error_and_exit("bind() failed", strerror(errno), __LINE__);
+    // Remove a stale socket file left behind by a previous server, but
+    // never anything else that happens to be at the path
+    struct stat st;
+    if (unix_path[0] != '@' && lstat(unix_path, &st) == 0) {
+      if (!S_ISSOCK(st.st_mode))
+	error_and_exit("could not bind socket", "path exists and is not a socket", __LINE__);
+      if (unlink(unix_path) == -1)
+	error_and_exit("could not remove old socket: unlink() failed", strerror(errno), __LINE__);
+    }
+    else if (unix_path[0] != '@' && errno != ENOENT)
+      error_and_exit("could not check old socket: lstat() failed", strerror(errno), __LINE__);
+
+    // Bind address to socket
+    if(bind(sockfd, (struct sockaddr*)&serv_addr, addr_len) == -1)
+      error_and_exit("bind() failed", strerror(errno), __LINE__);
+  }
+  else {
+    struct sockaddr_in serv_addr;
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = INADDR_ANY;
+    serv_addr.sin_port = htons(port); // htons(portno)
+
+    // Bind address to socket
+    if(bind(sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) == -1)
+      error_and_exit("bind() failed", strerror(errno), __LINE__);
+  }
   
   if (debug == true)
     printf("Listening for connection...\n");
@@ -658,10 +1641,10 @@ int main(int argc, char* argv[])
   if (listen(sockfd, 5) == -1)
     error_and_exit("listen() failed", strerror(errno), __LINE__);
   
-  struct sockaddr client_addr;
+  struct sockaddr_storage client_addr;
   socklen_t client_len = sizeof(client_addr);
   {
-    client_sockfd = accept(sockfd, &client_addr, &client_len);
+    client_sockfd = accept(sockfd, (struct sockaddr*)&client_addr, &client_len);
     if (client_sockfd == -1)
       error_and_exit("accept() failed", strerror(errno), __LINE__);
   }
@@ -669,7 +1652,12 @@ int main(int argc, char* argv[])
   if (debug == true)
     printf("Connection accepted!\n");
 
-  int exit_value = execute_with_shell();
+  // Only one client is served, so the socket file is no longer needed
+  if (unix_path != NULL && unix_path[0] != '@' && unlink(unix_path) == -1)
+    error_and_exit("could not remove socket: unlink() failed", strerror(errno), __LINE__);
+
+  pool_init();
+  int exit_value = mux == true ? process_mux() : execute_with_shell();
   if (close(client_sockfd) == -1)
     error_and_exit("could not close socket with client: close() failed", strerror(errno), __LINE__);
 
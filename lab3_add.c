@@ -1,4 +1,8 @@
-#define _POSIX_C_SOURCE 199309L
+/*
+ * Build with
+ *   gcc -o lab3_add lab3_add.c lab3_locks.c lab3_topology.c lab3_perf.c lab3_timing.c -lpthread
+ */
+#define _POSIX_C_SOURCE 200112L
 #include <getopt.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -6,18 +10,72 @@
 #include <errno.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include "lab3_locks.h"
+#include "lab3_topology.h"
+#include "lab3_perf.h"
+#include "lab3_timing.h"
 
 int num_threads, iterations;
 int opt_yield;
 int debug;
-char sync;
+int no_csv;
+char* cpus_list;
+char* placement;
+int* plan;  // CPU for each thread when pinning, else NULL
+int opt_perf;
+int sample_every;  // --latency: time every Nth operation, 0 when off
+struct histogram *op_hist, *wait_hist;  // one of each per thread
+long long duration;  // --duration in ns, 0 to run --iterations once
+struct work cs_work, think_work;  // inside the critical section, between operations
+char *cs_arg, *think_arg;
+char* cs_buf;  // lines touched by --cs-work, shared like the counter
+char sync; // 'l' for any lock in lab3_locks.h, 'c' for CAS, 'a' for fetch_add, '1' for C11
 char test_name[100];
-pthread_mutex_t lock;
-int spin_lock;
+int lock_kind;
+struct lock lock;
+
+/*
+ * Counter modes (--counter).  shared: every thread adds to one counter,
+ * synchronized by --sync.  sharded: each thread adds to its own slot, padded
+ * to a cache line, and the slots are summed when the counter is read.
+ * combining: flat combining, where threads post their update in a padded
+ * record and whoever takes the combiner lock applies every posted update to
+ * the one counter.
+ */
+enum { COUNTER_SHARED, COUNTER_SHARDED, COUNTER_COMBINING };
+int counter_mode;
+
+struct counter_slot {
+  volatile long long value;
+  volatile int pending;  // combining: value is waiting to be applied
+} __attribute__((aligned(CACHE_LINE)));
+
+/*
+ * C11 modes (--sync=relaxed, seqcst, acqrel-spin, seqcst-spin or weak-cas),
+ * built on <stdatomic.h> with explicit memory orders, to compare against the
+ * __sync builtins above, which are all full barriers.  relaxed and seqcst
+ * are a fetch_add; the spin modes are a test-and-test-and-set lock whose
+ * exchange and release store use acquire/release or seq_cst; weak-cas is a
+ * relaxed compare_exchange_weak retry loop.
+ */
+enum { C11_RELAXED, C11_SEQCST, C11_ACQREL_SPIN, C11_SEQCST_SPIN, C11_WEAK_CAS };
+const char* c11_names[] = { "relaxed", "seqcst", "acqrel-spin", "seqcst-spin", "weak-cas", NULL };
+int c11_mode;
+atomic_int c11_lock;
+
+struct counter_slot* slots;
+volatile int combiner_lock;
+long long combined_counter;
+
+struct thread_arg {
+  long long* counter;
+  int id;
+};
 
 void error_and_exit2(const char* message, int error, const int line, int retval)
 {
@@ -30,25 +88,95 @@ void error_and_exit(const char* message, int error, const int line)
   error_and_exit2(message, error, line, 1);
 }
 
-void add(long long *pointer, long long value)
+// The memory orders are spelled out in each branch: a non-constant order is
+// treated as seq_cst by the compiler
+void add_c11(long long *pointer, long long value)
+{
+  _Atomic long long* counter = (_Atomic long long*)pointer;
+  if (c11_mode == C11_RELAXED || c11_mode == C11_SEQCST) {
+    if (opt_yield)
+      sched_yield();
+    if (c11_mode == C11_RELAXED)
+      atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+    else
+      atomic_fetch_add_explicit(counter, value, memory_order_seq_cst);
+    return;
+  }
+
+  struct backoff_state state;
+  backoff_reset(&state);
+  if (c11_mode == C11_WEAK_CAS) {
+    long long old = atomic_load_explicit(counter, memory_order_relaxed);
+    while (1) {
+      work_do(&cs_work, cs_buf);
+      if (opt_yield)
+	sched_yield();
+      // A failed (possibly spurious) exchange reloads old
+      if (atomic_compare_exchange_weak_explicit(counter, &old, old + value,
+						memory_order_relaxed, memory_order_relaxed))
+	break;
+      backoff_wait(&state);
+    }
+    return;
+  }
+
+  int seq_cst = c11_mode == C11_SEQCST_SPIN;
+  while (seq_cst ? atomic_exchange_explicit(&c11_lock, 1, memory_order_seq_cst) :
+	 atomic_exchange_explicit(&c11_lock, 1, memory_order_acquire)) {
+    while (atomic_load_explicit(&c11_lock, memory_order_relaxed))
+      backoff_wait(&state);
+  }
+  long long sum = *pointer + value;
+  work_do(&cs_work, cs_buf);
+  if (opt_yield)
+    sched_yield();
+  *pointer = sum;
+  if (seq_cst)
+    atomic_store_explicit(&c11_lock, 0, memory_order_seq_cst);
+  else
+    atomic_store_explicit(&c11_lock, 0, memory_order_release);
+}
+
+// wait, if not NULL, records how long the lock took to acquire
+void add(long long *pointer, long long value, struct lock_node** node, struct histogram* wait)
 {
-  if (sync == 'm') {
-    pthread_mutex_lock(&lock);
+  if (sync == '1') {
+    add_c11(pointer, value);
+    return;
+  }
+  if (sync == 'a') {
+    if (opt_yield)
+      sched_yield();
+    __atomic_fetch_add(pointer, value, __ATOMIC_SEQ_CST);
+    return;
   }
-  else if (sync == 's') {
-    while (__sync_lock_test_and_set(&spin_lock, 1));
+
+  if (sync == 'l') {
+    uint64_t start = wait != NULL ? timing_now() : 0;
+    lock_acquire(&lock, node);
+    if (wait != NULL)
+      hist_record(wait, timing_now() - start);
   }
 
   long long old, sum;
 
-  if (sync != 'c')
+  if (sync != 'c') {
     sum = *pointer + value;
+    work_do(&cs_work, cs_buf);
+  }
   else {
-    do {
+    struct backoff_state state;
+    backoff_reset(&state);
+    while (1) {
       old = *pointer;
+      // The work is redone if the CAS fails, as an optimistic update would
+      work_do(&cs_work, cs_buf);
       if (opt_yield)
 	sched_yield();
-    } while (__sync_val_compare_and_swap(pointer, old, old + value) != old);
+      if (__sync_val_compare_and_swap(pointer, old, old + value) == old)
+	break;
+      backoff_wait(&state);
+    }
   }
 
   if (sync != 'c' && opt_yield)
@@ -57,20 +185,129 @@ void add(long long *pointer, long long value)
   if (sync != 'c')
     *pointer = sum;
 
-  if (sync == 'm') {
-    pthread_mutex_unlock(&lock);
+  if (sync == 'l')
+    lock_release(&lock, node);
+}
+
+// Only the owning thread writes a slot, so no read-modify-write is needed
+void add_sharded(struct counter_slot* slot, long long value)
+{
+  if (opt_yield)
+    sched_yield();
+  __atomic_store_n(&slot->value, slot->value + value, __ATOMIC_RELAXED);
+}
+
+void add_combining(struct counter_slot* slot, long long value)
+{
+  slot->value = value;
+  __atomic_store_n(&slot->pending, 1, __ATOMIC_RELEASE);
+  while (__atomic_load_n(&slot->pending, __ATOMIC_ACQUIRE)) {
+    if (__atomic_load_n(&combiner_lock, __ATOMIC_RELAXED) == 0 &&
+	__sync_lock_test_and_set(&combiner_lock, 1) == 0) {
+      // Apply every posted update, ours included
+      for (int i = 0; i < num_threads; i++) {
+	if (__atomic_load_n(&slots[i].pending, __ATOMIC_ACQUIRE)) {
+	  combined_counter += slots[i].value;
+	  __atomic_store_n(&slots[i].pending, 0, __ATOMIC_RELEASE);
+	}
+      }
+      __sync_lock_release(&combiner_lock);
+    }
+    else if (opt_yield)
+      sched_yield();
+    else
+      cpu_relax();
   }
-  else if (sync == 's') {
-    __sync_lock_release(&spin_lock);
+}
+
+// Sum of the slots; exact once the threads are done
+long long read_sharded()
+{
+  long long sum = 0;
+  for (int i = 0; i < num_threads; i++)
+    sum += __atomic_load_n(&slots[i].value, __ATOMIC_RELAXED);
+  return sum;
+}
+
+void run_op(struct thread_arg* arg, long long value, struct lock_node** node, struct histogram* wait)
+{
+  if (counter_mode == COUNTER_SHARDED)
+    add_sharded(slots + arg->id, value);
+  else if (counter_mode == COUNTER_COMBINING)
+    add_combining(slots + arg->id, value);
+  else
+    add(arg->counter, value, node, wait);
+}
+
+// Like run_op(), timing every sample_every'th call
+void run_sampled(struct thread_arg* arg, long long value, struct lock_node** node, int* countdown)
+{
+  if (--*countdown > 0) {
+    run_op(arg, value, node, NULL);
+    return;
   }
+  *countdown = sample_every;
+  uint64_t start = timing_now();
+  run_op(arg, value, node, wait_hist + arg->id);
+  hist_record(op_hist + arg->id, timing_now() - start);
+}
+
+// Count an operation and do the --think-work before the next one
+static inline void op_done(struct thread_progress* done, char* think_buf)
+{
+  progress_add(done, 1);
+  work_do(&think_work, think_buf);
 }
 
-void *thread_start(void *counter)
+void *thread_start(void *p)
 {
-  for (int i = 0; i < iterations; i++)
-    add((long long *)counter, 1);
-  for (int i = 0; i < iterations; i++)
-    add((long long *)counter, -1);
+  struct thread_arg* arg = p;
+  if (plan != NULL)
+    topology_pin(plan[arg->id]);
+  // Queue node for MCS and CLH; the other locks ignore it
+  struct lock_node* node = lock_node_new();
+  struct thread_progress* done = progress + arg->id;
+  char* think_buf = work_buffer(&think_work);  // private to the thread
+  struct perf_thread perf;
+  int countdown = 1;
+  window_wait();
+  if (opt_perf)
+    perf_start(&perf);
+
+  // With --duration, repeat the iterations until the time is up
+  do {
+    if (sample_every) {
+      for (int i = 0; i < iterations; i++, op_done(done, think_buf))
+	run_sampled(arg, 1, &node, &countdown);
+      for (int i = 0; i < iterations; i++, op_done(done, think_buf))
+	run_sampled(arg, -1, &node, &countdown);
+    }
+    else if (counter_mode == COUNTER_SHARDED) {
+      for (int i = 0; i < iterations; i++, op_done(done, think_buf))
+	add_sharded(slots + arg->id, 1);
+      for (int i = 0; i < iterations; i++, op_done(done, think_buf))
+	add_sharded(slots + arg->id, -1);
+    }
+    else if (counter_mode == COUNTER_COMBINING) {
+      for (int i = 0; i < iterations; i++, op_done(done, think_buf))
+	add_combining(slots + arg->id, 1);
+      for (int i = 0; i < iterations; i++, op_done(done, think_buf))
+	add_combining(slots + arg->id, -1);
+    }
+    else {
+      for (int i = 0; i < iterations; i++, op_done(done, think_buf))
+	add(arg->counter, 1, &node, NULL);
+      for (int i = 0; i < iterations; i++, op_done(done, think_buf))
+	add(arg->counter, -1, &node, NULL);
+    }
+  } while (duration && !__atomic_load_n(&window_stop, __ATOMIC_ACQUIRE));
+
+  // The first thread to finish ends the window in which all were running
+  window_close();
+  if (opt_perf)
+    perf_stop(&perf);
+  lock_node_free(node);
+  free(think_buf);
   return 0;
 }
 
@@ -78,6 +315,7 @@ void process_arguments(int argc, char* argv[])
 {
   // Setup argument processing
   int longindex = -1;
+  char* sync_name = NULL;
   num_threads = 1;
   iterations = 1;
   opt_yield = 0;
@@ -90,6 +328,16 @@ void process_arguments(int argc, char* argv[])
     {"yield", no_argument, 0, 0},
     {"sync", required_argument, 0, 0},
     {"debug", no_argument, 0, 0},
+    {"counter", required_argument, 0, 0},
+    {"no-csv", no_argument, 0, 0},
+    {"cpus", required_argument, 0, 0},
+    {"placement", required_argument, 0, 0},
+    {"perf", no_argument, 0, 0},
+    {"backoff", required_argument, 0, 0},
+    {"latency", optional_argument, 0, 0},
+    {"duration", required_argument, 0, 0},
+    {"cs-work", required_argument, 0, 0},
+    {"think-work", required_argument, 0, 0},
     {0, 0, 0, 0}
   };
 
@@ -125,21 +373,129 @@ void process_arguments(int argc, char* argv[])
       strcpy(test_name, "add-yield-");
     }
     else if (longindex == 3) {
-      sync = *optarg;
-      if (sync != 'm' && sync != 's' && sync != 'c') {
-	fprintf(stderr, "Invalid sync option: %s\n", optarg);
-	exit(1);
+      if (strcmp(optarg, "c") == 0)
+	sync = 'c';
+      else if (strcmp(optarg, "atomic") == 0)
+	sync = 'a';
+      else if ((lock_kind = lock_parse(optarg)) != -1)
+	sync = 'l';
+      else {
+	for (c11_mode = 0; c11_names[c11_mode] != NULL; c11_mode++) {
+	  if (strcmp(optarg, c11_names[c11_mode]) == 0)
+	    break;
+	}
+	if (c11_names[c11_mode] == NULL) {
+	  fprintf(stderr, "Invalid sync option: %s (expected %s, c, atomic, relaxed, seqcst, "
+		  "acqrel-spin, seqcst-spin or weak-cas)\n", optarg, lock_names);
+	  exit(1);
+	}
+	sync = '1';
       }
+      sync_name = optarg;
     }
     else if (longindex == 4) {
       debug = 1;
     }
+    else if (longindex == 5) {
+      if (strcmp(optarg, "shared") == 0)
+	counter_mode = COUNTER_SHARED;
+      else if (strcmp(optarg, "sharded") == 0)
+	counter_mode = COUNTER_SHARDED;
+      else if (strcmp(optarg, "combining") == 0)
+	counter_mode = COUNTER_COMBINING;
+      else {
+	fprintf(stderr, "Invalid counter option: %s (expected shared, sharded or combining)\n", optarg);
+	exit(1);
+      }
+    }
+    else if (longindex == 6) {
+      no_csv = 1;
+    }
+    else if (longindex == 7) {
+      cpus_list = optarg;
+    }
+    else if (longindex == 8) {
+      placement = optarg;
+      if (placement_parse(placement) == -1) {
+	fprintf(stderr, "Invalid placement option: %s (expected %s)\n", optarg, placement_names);
+	exit(1);
+      }
+    }
+    else if (longindex == 9) {
+      opt_perf = 1;
+    }
+    else if (longindex == 10) {
+      if (backoff_parse(optarg) == -1) {
+	fprintf(stderr, "Invalid backoff option: %s (expected none, pause, ttas, exp or yield, "
+		"optionally followed by ,min=N ,max=N ,spins=N)\n", optarg);
+	exit(1);
+      }
+    }
+    else if (longindex == 11) {
+      sample_every = optarg != NULL ? atoi(optarg) : 1;
+      if (sample_every <= 0) {
+	fprintf(stderr, "Invalid latency sampling interval: %s\n", optarg);
+	exit(1);
+      }
+    }
+    else if (longindex == 12) {
+      duration = duration_parse(optarg);
+      if (duration == -1) {
+	fprintf(stderr, "Invalid duration: %s (expected e.g. 5s, 500ms or 2m)\n", optarg);
+	exit(1);
+      }
+    }
+    else if (longindex == 13 || longindex == 14) {
+      struct work* w = longindex == 13 ? &cs_work : &think_work;
+      if (work_parse(optarg, w) == -1) {
+	fprintf(stderr, "Invalid %s option: %s (expected N cycles or Nl cache lines)\n",
+		long_options[longindex].name, optarg);
+	exit(1);
+      }
+      if (longindex == 13)
+	cs_arg = optarg;
+      else
+	think_arg = optarg;
+    }
+  }
+  // Sharded and combining counters bring their own synchronization
+  if (counter_mode != COUNTER_SHARED && (sync != '0' || cs_arg != NULL)) {
+    fprintf(stderr, "--sync and --cs-work only apply to --counter=shared\n");
+    exit(1);
+  }
+  if ((sync == 'a' || (sync == '1' && c11_mode <= C11_SEQCST)) && cs_arg != NULL) {
+    fprintf(stderr, "--cs-work needs a critical section; --sync=%s has none\n", sync_name);
+    exit(1);
   }
   // Add sync type to name
   if (sync != '0')
-    strncat(test_name, &sync, 1);
+    strncat(test_name, sync_name, 20);
   else
     strcat(test_name, "none");
+  if (backoff.kind != BACKOFF_NONE) {
+    strcat(test_name, "-");
+    strcat(test_name, backoff.name);
+  }
+  if (cs_arg != NULL) {
+    strcat(test_name, "-cs");
+    strncat(test_name, cs_arg, 10);
+  }
+  if (think_arg != NULL) {
+    strcat(test_name, "-think");
+    strncat(test_name, think_arg, 10);
+  }
+  if (counter_mode == COUNTER_SHARDED)
+    strcat(test_name, "-sharded");
+  else if (counter_mode == COUNTER_COMBINING)
+    strcat(test_name, "-combining");
+
+  // Pinned runs record their placement
+  if (cpus_list != NULL || placement != NULL) {
+    if (placement == NULL)
+      placement = "compact";
+    strcat(test_name, "-");
+    strcat(test_name, placement);
+  }
 }
 
 
@@ -162,30 +518,58 @@ int main(int argc, char* argv[])
   if (debug)
     printf("threads=%d\niterations=%d\n", num_threads, iterations);
 
-  // Initialize mutex and locks
-  if (sync == 'm') {
-    pthread_mutex_init(&lock, NULL);
+  // Initialize locks
+  if (sync == 'l')
+    lock_init(&lock, lock_kind);
+
+  // Decide where each thread runs
+  if (placement != NULL) {
+    plan = malloc(num_threads * sizeof(int));
+    if (plan == NULL)
+      error_and_exit2("malloc() failed", errno, __LINE__, 2);
+    topology_plan(cpus_list, placement, num_threads, plan);
+    if (debug) {
+      for (int i = 0; i < num_threads; i++)
+	printf("thread %d -> cpu %d\n", i, plan[i]);
+    }
   }
-  else if (sync == 's') {
-    spin_lock = 0;
+
+  // One padded slot per thread for the sharded and combining counters
+  if (counter_mode != COUNTER_SHARED) {
+    int c = posix_memalign((void**)&slots, CACHE_LINE, num_threads * sizeof(struct counter_slot));
+    if (c != 0)
+      error_and_exit2("posix_memalign() failed", c, __LINE__, 2);
+    memset(slots, 0, num_threads * sizeof(struct counter_slot));
   }
 
-  // Get start time
-  struct timespec start;
-  if (clock_gettime(CLOCK_MONOTONIC, &start) == -1)
-    error_and_exit2("clock_gettime() failed", errno, __LINE__, 2);
+  // Lines touched by --cs-work
+  cs_buf = work_buffer(&cs_work);
+
+  // Per-thread latency histograms
+  if (sample_every) {
+    timing_calibrate();
+    op_hist = calloc(num_threads, sizeof(struct histogram));
+    wait_hist = calloc(num_threads, sizeof(struct histogram));
+    if (op_hist == NULL || wait_hist == NULL)
+      error_and_exit2("calloc() failed", errno, __LINE__, 2);
+  }
 
-  // Create and run threads
+  // Create and run threads; timing starts when all of them are ready
+  window_init(num_threads, duration);
   long long counter = 0;
   if (debug)
     printf("counter before: %lld\n", counter);
 
   pthread_t threads[num_threads];
+  struct thread_arg args[num_threads];
   for (int i = 0; i < num_threads; i++) {
-    int c = pthread_create(&threads[i], NULL, thread_start, (void *)&counter);
+    args[i].counter = &counter;
+    args[i].id = i;
+    int c = pthread_create(&threads[i], NULL, thread_start, (void *)(args + i));
     if (c != 0)
       error_and_exit2("p_thread_create() failed", c, __LINE__, 2);
   }
+  window_run();
 
   for (int i = 0; i < num_threads; i++) {
     int c = pthread_join(threads[i], NULL);
@@ -194,11 +578,19 @@ int main(int argc, char* argv[])
   }
 
   // Get end time
-  struct timespec end;
-  if (clock_gettime(CLOCK_MONOTONIC, &end) == -1)
-    error_and_exit2("clock_gettime() failed", errno, __LINE__, 2);
-  long long runtime = 1000000000 * (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec);
-  int ops = num_threads * iterations * 2;
+  long long runtime = window_elapsed();
+  long long ops = progress_total();
+  double throughput = window_throughput();
+  window_destroy();
+  if (sync == 'l')
+    lock_destroy(&lock);
+  if (counter_mode == COUNTER_SHARDED)
+    counter = read_sharded();
+  else if (counter_mode == COUNTER_COMBINING)
+    counter = combined_counter;
+  free(slots);
+  free(plan);
+  free(cs_buf);
   long long average = runtime/ops;
 
 
@@ -206,9 +598,26 @@ int main(int argc, char* argv[])
     printf("counter after: %lld\n", counter);
 
   // Write to stdout and CSV
-  char output[100];
-  sprintf(output, "%s,%d,%d,%d,%lld,%lld,%lld\n", test_name, num_threads, iterations, ops, runtime, \
-	  average, counter);
+  // The last standard column is the throughput in ops/sec while all threads
+  // ran.  --perf appends the counter totals as extra columns, then --latency
+  // the operation and lock-wait percentiles
+  char output[600];
+  sprintf(output, "%s,%d,%d,%lld,%lld,%lld,%lld,%.0f", test_name, num_threads, iterations, ops, \
+	  runtime, average, counter, throughput);
+  if (opt_perf)
+    perf_format(output);
+  if (sample_every) {
+    for (int i = 1; i < num_threads; i++) {
+      hist_merge(op_hist, op_hist + i);
+      hist_merge(wait_hist, wait_hist + i);
+    }
+    hist_format(output, op_hist);
+    hist_format(output, wait_hist);
+    free(op_hist);
+    free(wait_hist);
+  }
+  strcat(output, "\n");
   printf(output);
-  write_csv(output);
+  if (!no_csv)
+    write_csv(output);
 }
@@ -0,0 +1,541 @@
+#define _POSIX_C_SOURCE 200112L
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+/*
+ * Benchmark matrix runner for lab3_add and lab3_list.  Runs the benchmark for
+ * every combination of --threads, --iterations, --lists and --sync, with
+ * --warmup discarded runs and --reps measured runs per cell, and reports the
+ * mean, standard deviation, minimum and median cost per operation.  Results
+ * go to a JSON and a CSV file together with a description of the machine.
+ *
+ * Each value option takes a comma-separated list, e.g.
+ *   ./lab3_bench --bench=list --threads=1,2,4,8 --sync=m,s --lists=1,4
+ * "none" in --sync runs without --sync.  With --perf the benchmarks also
+ * count hardware events, reported per operation (-1 where unavailable).
+ * --latency[=N] passes the option on and reports the mean over the runs of
+ * each operation and lock-wait percentile.  --oversubscribe=1,2,4,8 replaces
+ * --threads with those multiples of the online CPU count, e.g.
+ *   ./lab3_bench --sync=s,futex,adaptive --oversubscribe=1,2,4,8 --args="--cs-work=500"
+ *
+ * Build with
+ *   gcc -o lab3_bench lab3_bench.c -lm
+ */
+
+#define MAX_VALUES 32
+#define MAX_REPS 1000
+#define MAX_ARGS 32
+#define FIXED_ARGS 9  // run_once()'s own arguments and the terminating NULL
+#define PERF_COUNTERS 5  // columns lab3_perf.c appends with --perf
+
+const char* perf_names[PERF_COUNTERS] = {
+  "cycles", "instructions", "cache_misses", "llc_misses", "context_switches"
+};
+
+#define LATENCY_COLUMNS 10  // columns lab3_timing.c appends with --latency
+
+const char* latency_names[LATENCY_COLUMNS] = {
+  "op_p50", "op_p90", "op_p99", "op_p999", "op_max",
+  "wait_p50", "wait_p90", "wait_p99", "wait_p999", "wait_max"
+};
+
+char* bench;
+char* program;
+int threads[MAX_VALUES], iterations[MAX_VALUES], lists[MAX_VALUES];
+int num_threads, num_iterations, num_lists;
+char* syncs[MAX_VALUES];
+int num_syncs;
+char* extra[MAX_ARGS];
+int num_extra;
+int warmup, reps;
+char* json_file;
+char* csv_file;
+int debug;
+int opt_perf;
+char* opt_latency;  // --latency argument, "" for the default interval
+
+void error_and_exit(const char* message, int error, const int line)
+{
+  fprintf(stderr, "ERROR: %s at line %d: %s\n", message, line, strerror(error));
+  exit(1);
+}
+
+int parse_ints(char* arg, int* values, const char* name)
+{
+  int n = 0;
+  for (char* tok = strtok(arg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+    if (n == MAX_VALUES || atoi(tok) <= 0) {
+      fprintf(stderr, "Invalid --%s list: %s\n", name, tok);
+      exit(1);
+    }
+    values[n++] = atoi(tok);
+  }
+  return n;
+}
+
+int parse_strings(char* arg, char** values, int max, const char* sep)
+{
+  int n = 0;
+  for (char* tok = strtok(arg, sep); tok != NULL; tok = strtok(NULL, sep)) {
+    if (n == max) {
+      fprintf(stderr, "Too many values: %s\n", tok);
+      exit(1);
+    }
+    values[n++] = tok;
+  }
+  return n;
+}
+
+void process_arguments(int argc, char* argv[])
+{
+  int longindex = -1;
+  int oversub[MAX_VALUES], num_oversub = 0;
+  bench = "add";
+  program = NULL;
+  warmup = 1;
+  reps = 5;
+  json_file = "lab3_bench.json";
+  csv_file = "lab3_bench.csv";
+  static struct option long_options[] = {
+    {"bench", required_argument, 0, 0},
+    {"program", required_argument, 0, 0},
+    {"threads", required_argument, 0, 0},
+    {"iterations", required_argument, 0, 0},
+    {"lists", required_argument, 0, 0},
+    {"sync", required_argument, 0, 0},
+    {"args", required_argument, 0, 0},
+    {"warmup", required_argument, 0, 0},
+    {"reps", required_argument, 0, 0},
+    {"json", required_argument, 0, 0},
+    {"csv", required_argument, 0, 0},
+    {"debug", no_argument, 0, 0},
+    {"perf", no_argument, 0, 0},
+    {"latency", optional_argument, 0, 0},
+    {"oversubscribe", required_argument, 0, 0},
+    {0, 0, 0, 0}
+  };
+
+  while(1) {
+    int c = getopt_long(argc, argv, ":", long_options, &longindex);
+    if (c == -1)
+      break;
+    else if (c == '?') {
+      fprintf(stderr, "Unrecognized option: %s\n", argv[optind-1]);
+      exit(1);
+    }
+    else if (c == ':') {
+      fprintf(stderr, "Missing required argument: %s\n", argv[optind-1]);
+      exit(1);
+    }
+
+    if (longindex == 0) {
+      bench = optarg;
+      if (strcmp(bench, "add") != 0 && strcmp(bench, "list") != 0) {
+	fprintf(stderr, "Invalid bench option: %s (expected add or list)\n", optarg);
+	exit(1);
+      }
+    }
+    else if (longindex == 1)
+      program = optarg;
+    else if (longindex == 2)
+      num_threads = parse_ints(optarg, threads, "threads");
+    else if (longindex == 3)
+      num_iterations = parse_ints(optarg, iterations, "iterations");
+    else if (longindex == 4)
+      num_lists = parse_ints(optarg, lists, "lists");
+    else if (longindex == 5)
+      num_syncs = parse_strings(optarg, syncs, MAX_VALUES, ",");
+    else if (longindex == 6)
+      num_extra = parse_strings(optarg, extra, MAX_ARGS - FIXED_ARGS, " ");
+    else if (longindex == 7) {
+      warmup = atoi(optarg);
+      if (warmup < 0) {
+	fprintf(stderr, "Invalid number of warmup runs: %s\n", optarg);
+	exit(1);
+      }
+    }
+    else if (longindex == 8) {
+      reps = atoi(optarg);
+      if (reps <= 0 || reps > MAX_REPS) {
+	fprintf(stderr, "Invalid number of repetitions: %s\n", optarg);
+	exit(1);
+      }
+    }
+    else if (longindex == 9)
+      json_file = optarg;
+    else if (longindex == 10)
+      csv_file = optarg;
+    else if (longindex == 11)
+      debug = 1;
+    else if (longindex == 12)
+      opt_perf = 1;
+    else if (longindex == 13)
+      opt_latency = optarg != NULL ? optarg : "";
+    else if (longindex == 14)
+      num_oversub = parse_ints(optarg, oversub, "oversubscribe");
+  }
+
+  // Threads per CPU
+  if (num_oversub != 0) {
+    if (num_threads != 0) {
+      fprintf(stderr, "--threads and --oversubscribe are mutually exclusive\n");
+      exit(1);
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 0; i < num_oversub; i++)
+      threads[i] = oversub[i] * cpus;
+    num_threads = num_oversub;
+  }
+
+  // Defaults: a single cell
+  if (program == NULL)
+    program = strcmp(bench, "add") == 0 ? "./lab3_add" : "./lab3_list";
+  if (num_threads == 0)
+    threads[num_threads++] = 1;
+  if (num_iterations == 0)
+    iterations[num_iterations++] = 1000;
+  if (num_lists == 0 || strcmp(bench, "add") == 0) {
+    num_lists = 1;
+    lists[0] = 1;
+  }
+  if (num_syncs == 0)
+    syncs[num_syncs++] = "none";
+}
+
+/*
+ * Run the benchmark once and parse the line it prints.  Returns 0 and fills
+ * in the test name, the cost per operation, (lab3_list only) the average
+ * lock wait, the throughput with every thread running, with --perf the counters per operation and with --latency the
+ * percentiles, or returns -1 if the run failed.
+ */
+int run_once(int thread_count, int iteration_count, int list_count, const char* sync,
+	     char* test_name, double* ns_per_op, double* lock_wait, double* ops_per_sec,
+	     double* perf, double* latency)
+{
+  char arg_threads[32], arg_iterations[32], arg_lists[32], arg_sync[64], arg_latency[64];
+  char* args[MAX_ARGS];
+  int n = 0;
+  args[n++] = program;
+  sprintf(arg_threads, "--threads=%d", thread_count);
+  args[n++] = arg_threads;
+  sprintf(arg_iterations, "--iterations=%d", iteration_count);
+  args[n++] = arg_iterations;
+  if (strcmp(bench, "list") == 0) {
+    sprintf(arg_lists, "--lists=%d", list_count);
+    args[n++] = arg_lists;
+  }
+  if (strcmp(sync, "none") != 0) {
+    snprintf(arg_sync, sizeof(arg_sync), "--sync=%s", sync);
+    args[n++] = arg_sync;
+  }
+  args[n++] = "--no-csv";
+  if (opt_perf)
+    args[n++] = "--perf";
+  if (opt_latency != NULL) {
+    if (*opt_latency)
+      snprintf(arg_latency, sizeof(arg_latency), "--latency=%s", opt_latency);
+    else
+      strcpy(arg_latency, "--latency");
+    args[n++] = arg_latency;
+  }
+  for (int i = 0; i < num_extra; i++)
+    args[n++] = extra[i];
+  args[n] = NULL;
+
+  int pipefd[2];
+  if (pipe(pipefd) == -1)
+    error_and_exit("pipe() failed", errno, __LINE__);
+  pid_t pid = fork();
+  if (pid == -1)
+    error_and_exit("fork() failed", errno, __LINE__);
+  if (pid == 0) {
+    if (dup2(pipefd[1], 1) == -1)
+      error_and_exit("dup2() failed", errno, __LINE__);
+    close(pipefd[0]);
+    close(pipefd[1]);
+    execv(program, args);
+    error_and_exit("execv() failed", errno, __LINE__);
+  }
+  close(pipefd[1]);
+
+  // The result is the last line of output.  When the buffer fills up, drop
+  // everything before the line being read, so a chatty child is drained
+  // instead of blocking on a full pipe.
+  char output[4096];
+  int len = 0, bytes_read;
+  while ((bytes_read = read(pipefd[0], output + len, sizeof(output) - 1 - len)) > 0) {
+    len += bytes_read;
+    if (len == (int)sizeof(output) - 1) {
+      int keep = len - 1;
+      while (keep > 0 && output[keep-1] != '\n')
+	keep--;
+      // A single line longer than the buffer is never the result
+      if (keep == 0)
+	keep = len;
+      memmove(output, output + keep, len - keep);
+      len -= keep;
+    }
+  }
+  if (bytes_read == -1)
+    error_and_exit("read() failed", errno, __LINE__);
+  close(pipefd[0]);
+  output[len] = '\0';
+
+  int wstatus;
+  if (waitpid(pid, &wstatus, 0) == -1)
+    error_and_exit("waitpid() failed", errno, __LINE__);
+  if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0)
+    return -1;
+
+  while (len > 0 && output[len-1] == '\n')
+    output[--len] = '\0';
+  char* line = strrchr(output, '\n');
+  line = line == NULL ? output : line + 1;
+  if (debug)
+    fprintf(stderr, "%s\n", line);
+
+  // add: name,threads,iterations,ops,runtime,average,counter,ops/sec
+  // list: name,threads,iterations,lists,ops,runtime,average,lock wait,ops/sec
+  // followed by the --perf counters and the --latency percentiles
+  char* fields[32];
+  int num_fields = parse_strings(line, fields, 32, ",");
+  int ops_i = strcmp(bench, "add") == 0 ? 3 : 4;
+  int perf_i = ops_i + 5;
+  int latency_i = perf_i + (opt_perf ? PERF_COUNTERS : 0);
+  if (num_fields < latency_i + (opt_latency != NULL ? LATENCY_COLUMNS : 0))
+    return -1;
+  strncpy(test_name, fields[0], 99);
+  test_name[99] = '\0';
+  double ops = atof(fields[ops_i]);
+  *ns_per_op = ops > 0 ? atof(fields[ops_i+1]) / ops : 0;
+  *lock_wait = strcmp(bench, "list") == 0 ? atof(fields[ops_i+3]) : 0;
+  *ops_per_sec = atof(fields[ops_i+4]);
+  for (int i = 0; opt_perf && i < PERF_COUNTERS; i++) {
+    double value = atof(fields[perf_i+i]);
+    perf[i] = value < 0 || ops <= 0 ? -1 : value / ops;
+  }
+  for (int i = 0; opt_latency != NULL && i < LATENCY_COLUMNS; i++)
+    latency[i] = atof(fields[latency_i+i]);
+  return 0;
+}
+
+int compare_doubles(const void* a, const void* b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+struct stats {
+  double mean, stddev, min, median;
+};
+
+struct stats summarize(double* values, int n)
+{
+  struct stats s = {0, 0, 0, 0};
+  if (n == 0)
+    return s;
+  qsort(values, n, sizeof(double), compare_doubles);
+  for (int i = 0; i < n; i++)
+    s.mean += values[i];
+  s.mean /= n;
+  for (int i = 0; i < n; i++)
+    s.stddev += (values[i] - s.mean) * (values[i] - s.mean);
+  // Sample standard deviation
+  s.stddev = n > 1 ? sqrt(s.stddev / (n - 1)) : 0;
+  s.min = values[0];
+  s.median = n % 2 ? values[n/2] : (values[n/2-1] + values[n/2]) / 2;
+  return s;
+}
+
+struct machine {
+  char hostname[256];
+  struct utsname uts;
+  char cpu_model[256];
+  long cpus;
+  char date[64];
+};
+
+void get_machine(struct machine* m)
+{
+  if (gethostname(m->hostname, sizeof(m->hostname)) == -1)
+    strcpy(m->hostname, "unknown");
+  m->hostname[sizeof(m->hostname)-1] = '\0';
+  if (uname(&m->uts) == -1)
+    error_and_exit("uname() failed", errno, __LINE__);
+  m->cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  strcpy(m->cpu_model, "unknown");
+  FILE* cpuinfo = fopen("/proc/cpuinfo", "r");
+  if (cpuinfo != NULL) {
+    char line[512];
+    while (fgets(line, sizeof(line), cpuinfo) != NULL) {
+      char* colon = strchr(line, ':');
+      if (strncmp(line, "model name", 10) == 0 && colon != NULL) {
+	snprintf(m->cpu_model, sizeof(m->cpu_model), "%s", colon + 2);
+	m->cpu_model[strcspn(m->cpu_model, "\n")] = '\0';
+	break;
+      }
+    }
+    fclose(cpuinfo);
+  }
+
+  time_t now = time(NULL);
+  struct tm utc;
+  gmtime_r(&now, &utc);
+  strftime(m->date, sizeof(m->date), "%Y-%m-%dT%H:%M:%SZ", &utc);
+}
+
+// Write s as a JSON string
+void json_string(FILE* f, const char* s)
+{
+  fputc('"', f);
+  for (; *s != '\0'; s++) {
+    if (*s == '"' || *s == '\\')
+      fprintf(f, "\\%c", *s);
+    else if ((unsigned char)*s < 32)
+      fprintf(f, "\\u%04x", *s);
+    else
+      fputc(*s, f);
+  }
+  fputc('"', f);
+}
+
+int main(int argc, char* argv[])
+{
+  process_arguments(argc, argv);
+
+  struct machine m;
+  get_machine(&m);
+
+  FILE* json = fopen(json_file, "w");
+  if (json == NULL)
+    error_and_exit("could not open JSON file: fopen() failed", errno, __LINE__);
+  FILE* csv = fopen(csv_file, "w");
+  if (csv == NULL)
+    error_and_exit("could not open CSV file: fopen() failed", errno, __LINE__);
+
+  fprintf(json, "{\n  \"machine\": {\"hostname\": ");
+  json_string(json, m.hostname);
+  fprintf(json, ", \"os\": ");
+  json_string(json, m.uts.sysname);
+  fprintf(json, ", \"release\": ");
+  json_string(json, m.uts.release);
+  fprintf(json, ", \"arch\": ");
+  json_string(json, m.uts.machine);
+  fprintf(json, ", \"cpu\": ");
+  json_string(json, m.cpu_model);
+  fprintf(json, ", \"cpus\": %ld, \"date\": ", m.cpus);
+  json_string(json, m.date);
+  fprintf(json, "},\n  \"config\": {\"program\": ");
+  json_string(json, program);
+  fprintf(json, ", \"warmup\": %d, \"reps\": %d},\n  \"results\": [", warmup, reps);
+
+  fprintf(csv, "# host=%s os=%s %s arch=%s cpu=%s cpus=%ld date=%s warmup=%d reps=%d\n",
+	  m.hostname, m.uts.sysname, m.uts.release, m.uts.machine, m.cpu_model, m.cpus,
+	  m.date, warmup, reps);
+  fprintf(csv, "test,threads,iterations,lists,sync,runs,failures,"
+	  "mean_ns,stddev_ns,min_ns,median_ns,mean_lock_wait_ns,mean_ops_per_sec,stddev_ops_per_sec");
+  for (int i = 0; opt_perf && i < PERF_COUNTERS; i++)
+    fprintf(csv, ",%s_per_op", perf_names[i]);
+  for (int i = 0; opt_latency != NULL && i < LATENCY_COLUMNS; i++)
+    fprintf(csv, ",%s_ns", latency_names[i]);
+  fprintf(csv, "\n");
+
+  int cells = 0;
+  for (int s = 0; s < num_syncs; s++)
+    for (int l = 0; l < num_lists; l++)
+      for (int it = 0; it < num_iterations; it++)
+	for (int t = 0; t < num_threads; t++) {
+	  char test_name[100] = "";
+	  double ns[MAX_REPS], wait[MAX_REPS], rate[MAX_REPS];
+	  double perf_sum[PERF_COUNTERS] = {0};
+	  int perf_missing[PERF_COUNTERS] = {0};
+	  double latency_sum[LATENCY_COLUMNS] = {0};
+	  int runs = 0, failures = 0;
+	  for (int r = 0; r < warmup + reps; r++) {
+	    double ns_per_op, lock_wait, ops_per_sec, perf[PERF_COUNTERS], latency[LATENCY_COLUMNS];
+	    char name[100];
+	    if (run_once(threads[t], iterations[it], lists[l], syncs[s], name,
+			 &ns_per_op, &lock_wait, &ops_per_sec, perf, latency) == -1) {
+	      failures++;
+	      continue;
+	    }
+	    if (r < warmup)
+	      continue;
+	    strcpy(test_name, name);
+	    ns[runs] = ns_per_op;
+	    wait[runs] = lock_wait;
+	    rate[runs] = ops_per_sec;
+	    for (int i = 0; opt_perf && i < PERF_COUNTERS; i++) {
+	      if (perf[i] < 0)
+		perf_missing[i] = 1;
+	      perf_sum[i] += perf[i];
+	    }
+	    for (int i = 0; opt_latency != NULL && i < LATENCY_COLUMNS; i++)
+	      latency_sum[i] += latency[i];
+	    runs++;
+	  }
+	  struct stats st = summarize(ns, runs);
+	  struct stats wt = summarize(wait, runs);
+	  struct stats rt = summarize(rate, runs);
+
+	  printf("%s threads=%d iterations=%d lists=%d: mean %.2f ns/op, stddev %.2f, "
+		 "min %.2f, median %.2f, %.0f ops/sec (%d runs, %d failed)\n",
+		 test_name, threads[t], iterations[it], lists[l], st.mean, st.stddev,
+		 st.min, st.median, rt.mean, runs, failures);
+	  // Mean counters per operation; -1 if any run lacked the counter
+	  double perf_mean[PERF_COUNTERS];
+	  for (int i = 0; i < PERF_COUNTERS; i++)
+	    perf_mean[i] = perf_missing[i] || runs == 0 ? -1 : perf_sum[i] / runs;
+	  double latency_mean[LATENCY_COLUMNS];
+	  for (int i = 0; i < LATENCY_COLUMNS; i++)
+	    latency_mean[i] = runs == 0 ? 0 : latency_sum[i] / runs;
+
+	  fprintf(csv, "%s,%d,%d,%d,%s,%d,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.0f,%.0f", test_name,
+		  threads[t], iterations[it], lists[l], syncs[s], runs, failures,
+		  st.mean, st.stddev, st.min, st.median, wt.mean, rt.mean, rt.stddev);
+	  for (int i = 0; opt_perf && i < PERF_COUNTERS; i++)
+	    fprintf(csv, ",%.4f", perf_mean[i]);
+	  for (int i = 0; opt_latency != NULL && i < LATENCY_COLUMNS; i++)
+	    fprintf(csv, ",%.1f", latency_mean[i]);
+	  fprintf(csv, "\n");
+	  fprintf(json, "%s\n    {\"test\": ", cells++ ? "," : "");
+	  json_string(json, test_name);
+	  fprintf(json, ", \"threads\": %d, \"iterations\": %d, \"lists\": %d, \"sync\": ",
+		  threads[t], iterations[it], lists[l]);
+	  json_string(json, syncs[s]);
+	  fprintf(json, ", \"runs\": %d, \"failures\": %d, \"ns_per_op\": "
+		  "{\"mean\": %.3f, \"stddev\": %.3f, \"min\": %.3f, \"median\": %.3f}, "
+		  "\"lock_wait_ns\": {\"mean\": %.3f, \"median\": %.3f}, "
+		  "\"ops_per_sec\": {\"mean\": %.0f, \"stddev\": %.0f, \"median\": %.0f}",
+		  runs, failures, st.mean, st.stddev, st.min, st.median, wt.mean, wt.median,
+		  rt.mean, rt.stddev, rt.median);
+	  if (opt_perf) {
+	    fprintf(json, ", \"per_op\": {");
+	    for (int i = 0; i < PERF_COUNTERS; i++)
+	      fprintf(json, "%s\"%s\": %.4f", i ? ", " : "", perf_names[i], perf_mean[i]);
+	    fprintf(json, "}");
+	  }
+	  if (opt_latency != NULL) {
+	    fprintf(json, ", \"latency_ns\": {");
+	    for (int i = 0; i < LATENCY_COLUMNS; i++)
+	      fprintf(json, "%s\"%s\": %.1f", i ? ", " : "", latency_names[i], latency_mean[i]);
+	    fprintf(json, "}");
+	  }
+	  fprintf(json, "}");
+	}
+  fprintf(json, "\n  ]\n}\n");
+
+  if (fclose(json) == EOF || fclose(csv) == EOF)
+    error_and_exit("could not write results: fclose() failed", errno, __LINE__);
+  return 0;
+}
@@ -1,4 +1,9 @@
-#define _POSIX_C_SOURCE 199309L
+/*
+ * Build with
+ *   gcc -o lab3_list lab3_list.c SortedList.c lab3_skiplist.c lab3_lockfree.c lab3_locks.c \
+ *     lab3_topology.c lab3_perf.c lab3_timing.c -lpthread
+ */
+#define _POSIX_C_SOURCE 200112L
 #include <getopt.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -11,25 +16,74 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include "SortedList.h"
+#include "lab3_skiplist.h"
+#include "lab3_lockfree.h"
+#include "lab3_locks.h"
+#include "lab3_topology.h"
+#include "lab3_perf.h"
+#include "lab3_timing.h"
 #include <signal.h>
 
 int num_threads, iterations, num_lists;
 int debug;
-char sync;
+int no_csv;
+char* cpus_list;
+char* placement;
+int* plan;  // CPU for each thread when pinning, else NULL
+int opt_perf;
+int opt_bucket_stats;
+int opt_check_lists;  // --check-lists: walk every list under every lock for the length
+char sync; // 'l' for any lock in lab3_locks.h, 'f' for the lock-free list
 char test_name[100];
-pthread_mutex_t *lock;
-int *spin_lock;
+int lock_kind;
+struct lock *locks;
+struct lock_node **nodes; // MCS/CLH node for each thread and list
 int opt_yield;
 SortedList_t *list;
+// Partition data structure (--structure): SortedList.h or lab3_skiplist.h
+enum { STRUCTURE_LIST, STRUCTURE_SKIPLIST };
+int structure;
+struct skiplist *skiplists;
+struct skiplist_node *skip_nodes;  // one per element, same index
+struct lf_list *lf_lists;  // --sync=lockfree partitions
 #define KEYLEN 4
 #define NUMCHARS 128
 #define KEY 268435456 // equal to NUMCHARS^KEYLEN
 char key_list[KEY][KEYLEN];
 #define BILLION 1000000000
-int *lock_ops;
-struct timespec *thread_start, *thread_end;
-long long *lock_time;
+long long *lock_ops;
+long long *lock_time;  // TSC ticks spent acquiring locks, per thread
 int get_time;
+int lookups;  // --lookups: read-only lookups per element, between inserts and deletes
+#define SEQLOCK_RETRIES 8
+int sample_every;  // --latency: time every Nth operation, 0 when off
+struct histogram *op_hist, *wait_hist;  // one of each per thread
+long long duration;  // --duration in ns, 0 to run --iterations once
+// --resize: grow the table by linear hashing.  Buckets are split one at a
+// time, in order, whenever the average sublist length passes resize; the
+// number in use, active_lists, starts at num_lists and can reach max_lists.
+#define RESIZE_LENGTH 8
+int resize;  // average length that triggers a split, 0 when off
+int max_lists;  // partitions allocated
+volatile int active_lists;  // partitions in use
+volatile long long resize_count;  // elements in the table
+volatile int splitting;  // a thread is splitting a bucket
+unsigned *key_hashes;  // hash() of each element's key, same index
+SortedListElement_t *all_elements;  // main()'s elements, to index key_hashes
+int lists_pow2;  // num_lists is a power of two: buckets by mask, not modulo
+// --bucket-stats: sublist lengths seen by each thread's fullest getlen()
+struct bucket_stats {
+  int lists, elements, max;
+  double sum_sq;
+} *bucket_stats;
+// Elements in each partition, each count on a cache line of its own.  Under
+// a lock the count changes inside the critical section; the lock-free list
+// counts an insert before it and a delete after it, so no count is ever
+// below its partition's real length.
+struct part_count {
+  volatile long long n;
+} __attribute__((aligned(CACHE_LINE)));
+struct part_count *part_counts;
 
 
 void error_and_exit2(const char* message, int error, const int line, int retval)
@@ -62,73 +116,342 @@ struct thread_data
   //  long long *lock_time;
 };
 
-void acquire_lock(int thread_i, int list_i)
+// sampled: also record the wait in the thread's lock-wait histogram
+// shared: the caller only reads the list (a read lock for --sync=rw)
+void acquire_lock(int thread_i, int list_i, int sampled, int shared)
 {
   // Get start time
-  if (get_time && clock_gettime(CLOCK_MONOTONIC, thread_start+thread_i) == -1)
-    error_and_exit2("clock_gettime() failed", errno, __LINE__, 2);
+  uint64_t start = get_time || sampled ? timing_now() : 0;
 
   // Acquire lock
-  if (sync == 'm') {
-    pthread_mutex_lock(lock+list_i);
+  if (sync == 'l') {
+    if (shared)
+      lock_acquire_shared(locks+list_i, nodes + thread_i*max_lists + list_i);
+    else
+      lock_acquire(locks+list_i, nodes + thread_i*max_lists + list_i);
     if (get_time)
       lock_ops[thread_i]++;
   }
-  else if (sync == 's') {
-    while (__sync_lock_test_and_set(spin_lock+list_i, 1));
+  // Get end time
+  if (get_time || sampled) {
+    uint64_t elapsed = timing_now() - start;
     if (get_time)
-      lock_ops[thread_i]++;
+      lock_time[thread_i] += elapsed;
+    if (sampled)
+      hist_record(wait_hist + thread_i, elapsed);
   }
-  // Get end time
-  if (get_time) {
-    if (clock_gettime(CLOCK_MONOTONIC, thread_end+thread_i) == -1)
-      error_and_exit2("clock_gettime() failed", errno, __LINE__, 2);
-    // Calculate elapsed time
-    long long elapsed = BILLION * (thread_end[thread_i].tv_sec - thread_start[thread_i].tv_sec);
-    elapsed += thread_end[thread_i].tv_nsec - thread_start[thread_i].tv_nsec;
-    lock_time[thread_i] += elapsed;
+}
+
+void release_lock(int thread_i, int list_i, int shared)
+{
+  if (sync == 'l' && shared)
+    lock_release_shared(locks+list_i, nodes + thread_i*max_lists + list_i);
+  else if (sync == 'l')
+    lock_release(locks+list_i, nodes + thread_i*max_lists + list_i);
+}
+
+void count_add(int list_i, long long n)
+{
+  if (sync == 'l')
+    __atomic_store_n(&part_counts[list_i].n, part_counts[list_i].n + n, __ATOMIC_RELAXED);
+  else
+    __atomic_add_fetch(&part_counts[list_i].n, n, __ATOMIC_RELAXED);
+}
+
+// Partition operations, on whichever structure --structure (or
+// --sync=lockfree) chose, keeping part_counts up to date.  Elements are
+// passed by index so any kind of node can be found.
+void part_insert(int list_i, SortedListElement_t *elements, int i)
+{
+  if (sync == 'f') {
+    count_add(list_i, 1);
+    lf_insert(lf_lists+list_i, elements[i].key);
+    return;
   }
+  if (structure == STRUCTURE_SKIPLIST)
+    skiplist_insert(skiplists+list_i, skip_nodes+i);
+  else
+    SortedList_insert(list+list_i, elements+i);
+  count_add(list_i, 1);
+}
+
+void *part_lookup(int list_i, const char *key)
+{
+  if (sync == 'f')
+    return lf_lookup(lf_lists+list_i, key);
+  if (structure == STRUCTURE_SKIPLIST)
+    return skiplist_lookup(skiplists+list_i, key);
+  return SortedList_lookup(list+list_i, key);
 }
 
-void release_lock(int list_i)
+// Find element i for deletion.  Keys can repeat, so a lookup may find another
+// thread's node; return our own instead, which with --duration is inserted
+// again on the next pass.  The lock-free list deletes by key, so any non-NULL
+// result will do for it.
+void *part_find_own(int list_i, SortedListElement_t *elements, int i)
 {
-  if (sync == 'm') {
-    pthread_mutex_unlock(lock+list_i);
+  if (part_lookup(list_i, elements[i].key) == NULL)
+    return NULL;
+  if (sync != 'f' && structure == STRUCTURE_SKIPLIST)
+    return skip_nodes+i;
+  return elements+i;
+}
+
+// Returns 1 if the element was not properly linked.  The lock-free list
+// deletes by key, since the node found by a lookup may be gone already.
+int part_delete(int list_i, void *element, const char *key)
+{
+  int c;
+  if (sync == 'f')
+    c = lf_delete(lf_lists+list_i, key);
+  else if (structure == STRUCTURE_SKIPLIST)
+    c = skiplist_delete(skiplists+list_i, element);
+  else
+    c = SortedList_delete(element);
+  if (c == 0)
+    count_add(list_i, -1);
+  return c;
+}
+
+int part_length(int list_i)
+{
+  if (sync == 'f')
+    return lf_length(lf_lists+list_i);
+  if (structure == STRUCTURE_SKIPLIST)
+    return skiplist_length(skiplists+list_i);
+  return SortedList_length(list+list_i);
+}
+
+// Full hash of a key, which bucket_of() maps to a partition.  The key's
+// bytes (up to KEYLEN, or the NUL) are packed into a word and mixed with the
+// murmur3 finalizer, so every output bit, and so the bucket under a mask,
+// depends on every byte.  Computed once per element, into key_hashes.
+unsigned hash(const char* key)
+{
+  uint32_t x = 0;
+  for (int i = 0; i < KEYLEN && key[i] != '\0'; i++)
+    x |= (uint32_t)(unsigned char)key[i] << (8 * i);
+  x ^= x >> 16;
+  x *= 0x85ebca6b;
+  x ^= x >> 13;
+  x *= 0xc2b2ae35;
+  x ^= x >> 16;
+  return x;
+}
+
+// Linear hashing: with n buckets in use, the table is at modulus m (num_lists
+// doubled until 2m > n) and buckets below the split pointer n - m have been
+// split, their keys spread over b and b + m by the modulus 2m
+int bucket_of(unsigned h, int n)
+{
+  if (!resize)
+    return lists_pow2 ? h & (num_lists - 1) : h % num_lists;
+  unsigned m = num_lists;
+  while (m * 2 <= (unsigned)n)
+    m *= 2;
+  unsigned b = lists_pow2 ? h & (m * 2 - 1) : h % (m * 2);
+  if (b < (unsigned)n)
+    return b;
+  return lists_pow2 ? h & (m - 1) : h % m;
+}
+
+// Lock the partition for hash h and return it.  A split may move the key
+// between reading the table size and getting the lock, so with --resize
+// check the bucket again once the lock is held: splits take the lock of the
+// bucket they split, so while it is held the key stays put.
+int lock_bucket(int thread_i, unsigned h, int sampled, int shared)
+{
+  while (1) {
+    int list_i = bucket_of(h, __atomic_load_n(&active_lists, __ATOMIC_ACQUIRE));
+    acquire_lock(thread_i, list_i, sampled, shared);
+    if (!resize || bucket_of(h, __atomic_load_n(&active_lists, __ATOMIC_ACQUIRE)) == list_i)
+      return list_i;
+    release_lock(thread_i, list_i, shared);
   }
-  else if (sync == 's') {
-    __sync_lock_release(spin_lock+list_i);
+}
+
+// Move the elements of partition src that hash to dst under the modulus,
+// using the hashes cached in key_hashes
+void part_split(int src, unsigned dst, unsigned modulus)
+{
+  long long moved = 0;
+  if (structure == STRUCTURE_SKIPLIST) {
+    struct skiplist_node *x = skiplists[src].head.next[0];
+    while (x != NULL) {
+      struct skiplist_node *next = x->next[0];
+      if (key_hashes[x - skip_nodes] % modulus == dst) {
+	if (skiplist_delete(skiplists+src, x) == 1)
+	  corrupted_list_exit(__LINE__);
+	skiplist_insert(skiplists+dst, x);
+	moved++;
+      }
+      x = next;
+    }
   }
+  else {
+    SortedList_t *head = list+src;
+    SortedListElement_t *p = head->next;
+    while (p != NULL && p != head) {
+      SortedListElement_t *next = p->next;
+      if (key_hashes[p - all_elements] % modulus == dst) {
+	if (SortedList_delete(p) == 1)
+	  corrupted_list_exit(__LINE__);
+	SortedList_insert(list+dst, p);
+	moved++;
+      }
+      p = next;
+    }
+  }
+  count_add(src, -moved);
+  count_add(dst, moved);
 }
 
-int hash(const char* key)
+// Split the next bucket, unless the table is full, no longer over the
+// threshold, or another thread is already splitting.  The new bucket is
+// published only once its keys are in it, under the lock of the bucket split.
+void split_bucket(int thread_i)
 {
-  // View key as a 4-bit, base 128 number (4-bit key, 128 possible characters per bit)
-  // Convert this to decimal representation to get the hash
-  int hash = 0;
-  for (int i = 0; i < KEYLEN; i++) {
-    int base = 1;
-    for (int j = 1; j <= i; j++)
-      base *= NUMCHARS; // base = NUMCHARS^i
-    hash += (int)(key[i]) * base;
-  }
-  return hash % num_lists;
+  if (!__sync_bool_compare_and_swap(&splitting, 0, 1))
+    return;
+  int n = active_lists;
+  if (n < max_lists && __atomic_load_n(&resize_count, __ATOMIC_RELAXED) > (long long)resize * n) {
+    int m = num_lists;
+    while (m * 2 <= n)
+      m *= 2;
+    acquire_lock(thread_i, n - m, 0, 0);
+    part_split(n - m, n, m * 2);
+    __atomic_store_n(&active_lists, n + 1, __ATOMIC_RELEASE);
+    release_lock(thread_i, n - m, 0);
+  }
+  __atomic_store_n(&splitting, 0, __ATOMIC_RELEASE);
 }
 
-int getlen(int thread_i)
+/*
+ * Lookup for --sync=seqlock readers, which hold no lock: the list may be
+ * changing under us, so give up at anything inconsistent (a NULL link, or
+ * more steps than there are elements) and let the sequence check retry.
+ * Stop at any sentinel, not just our own: a split may move the element we
+ * are on, leaving us in another bucket's ring.
+ */
+SortedListElement_t *optimistic_lookup(SortedList_t *head, const char *key)
 {
-  // Get all locks
-  for (int i = 0; i < num_lists; i++)
-    acquire_lock(thread_i, i);
-  int len = 0;
-  for (int i = 0; i < num_lists; i++) {
-    int temp = SortedList_length(list+i);
-    if (temp < 0)
+  SortedListElement_t *p = *(SortedListElement_t *volatile *)&head->next;
+  for (int steps = 0; p != NULL && p->key != NULL && steps < num_threads * iterations; steps++) {
+    if (opt_yield & LOOKUP_YIELD)
+      sched_yield();
+    if (strcmp(p->key, key) == 0)
+      return p;
+    p = *(SortedListElement_t *volatile *)&p->next;
+  }
+  return NULL;
+}
+
+// Read-only lookup for --lookups: shared under rw, optimistic under seqlock
+// (falling back to the lock after SEQLOCK_RETRIES tries that found a writer
+// active or failed to validate).  An optimistic read also fails if a split
+// published a bucket in the meantime, since the key may have moved.
+int read_lookup(int thread_i, unsigned h, const char *key, int sampled)
+{
+  if (sync == 'l' && lock_kind == LOCK_SEQLOCK) {
+    for (int tries = 0; tries < SEQLOCK_RETRIES; tries++) {
+      int n = __atomic_load_n(&active_lists, __ATOMIC_ACQUIRE);
+      int list_i = bucket_of(h, n);
+      unsigned seq = lock_read_begin(locks+list_i);
+      if (lock_read_busy(seq)) {
+	cpu_relax();
+	continue;
+      }
+      int found = optimistic_lookup(list+list_i, key) != NULL;
+      if (lock_read_validate(locks+list_i, seq) &&
+	  __atomic_load_n(&active_lists, __ATOMIC_ACQUIRE) == n)
+	return found;
+    }
+  }
+  int list_i = lock_bucket(thread_i, h, sampled, 1);
+  int found = part_lookup(list_i, key) != NULL;
+  release_lock(thread_i, list_i, 1);
+  return found;
+}
+
+// Take every partition's lock, in order, and return how many there are.
+// Once they are all held no bucket can be split, but one may have been
+// while we were taking them.
+int lock_all(int thread_i)
+{
+  int n = 0;
+  while (n < __atomic_load_n(&active_lists, __ATOMIC_ACQUIRE))
+    acquire_lock(thread_i, n++, 0, 1);
+  return n;
+}
+
+void unlock_all(int thread_i, int n)
+{
+  for (int i = 0; i < n; i++)
+    release_lock(thread_i, i, 1);
+}
+
+// For --bucket-stats, keep the fullest table this thread has seen; the
+// caller holds every lock
+void record_stats(int thread_i, int n)
+{
+  int len = 0, max = 0;
+  double sum_sq = 0;
+  for (int i = 0; i < n; i++) {
+    int temp = part_counts[i].n;
+    len += temp;
+    if (temp > max)
+      max = temp;
+    sum_sq += (double)temp * temp;
+  }
+  if (len > bucket_stats[thread_i].elements) {
+    bucket_stats[thread_i].lists = n;
+    bucket_stats[thread_i].elements = len;
+    bucket_stats[thread_i].max = max;
+    bucket_stats[thread_i].sum_sq = sum_sq;
+  }
+}
+
+// Elements in the table from the partition counts, exactly: every lock is
+// held while they are summed, but no list is walked
+long long count_exact(int thread_i)
+{
+  int n = lock_all(thread_i);
+  long long len = 0;
+  for (int i = 0; i < n; i++)
+    len += part_counts[i].n;
+  if (bucket_stats != NULL)
+    record_stats(thread_i, n);
+  unlock_all(thread_i, n);
+  return len;
+}
+
+// Elements in the table from the partition counts, without any lock: each
+// count is read at a slightly different time, so the sum may be off by the
+// operations in flight
+long long count_approx()
+{
+  int n = __atomic_load_n(&active_lists, __ATOMIC_ACQUIRE);
+  long long len = 0;
+  for (int i = 0; i < n; i++)
+    len += __atomic_load_n(&part_counts[i].n, __ATOMIC_RELAXED);
+  return len;
+}
+
+// --check-lists: walk every list under every lock, checking it is in order
+// and, when a --sync lock holds it still, that it agrees with its count
+long long getlen(int thread_i)
+{
+  int n = lock_all(thread_i);
+  long long len = 0;
+  for (int i = 0; i < n; i++) {
+    int temp = part_length(i);
+    if (temp < 0 || (sync == 'l' && temp != part_counts[i].n))
       corrupted_list_exit(__LINE__);
     len += temp;
   }
-  // Release all locks
-  for (int i = 0; i < num_lists; i++)
-    release_lock(i);
+  if (bucket_stats != NULL)
+    record_stats(thread_i, n);
+  unlock_all(thread_i, n);
   return len;
 }
 
@@ -137,40 +460,94 @@ void *thread_run(void *arg)
   struct thread_data *thread_arg = (struct thread_data*)arg;
   SortedListElement_t *elements = thread_arg->elements;
   int thread_i = thread_arg->thread_num;
+  if (sync == 'f')
+    lf_thread_init(thread_i);
+  if (plan != NULL)
+    topology_pin(plan[thread_i]);
+  struct perf_thread perf;
+  struct thread_progress* done = progress + thread_i;
+  window_wait();
+  if (opt_perf)
+    perf_start(&perf);
   //  long long *lock_time = thread_arg->lock_time;
   int lower = thread_i * iterations;
   //  printf("%d ", SortedList_length(&list));
+  int countdown = 1;  // operations until the next sampled one
+  struct histogram* op = sample_every ? op_hist + thread_i : NULL;
 
-  for (int i = lower; i < lower + iterations; i++) {
-    int list_i = hash((elements+i)->key);
-    acquire_lock(thread_i, list_i);
-    //printf("Sending key: %d\n", (elements+i)->key);
-    // Figure out which sublist
-    SortedList_insert(list+list_i, elements+i);
-    release_lock(list_i);
-  }
-
-  int len = getlen(thread_i);
-  if (len < 0)
-    corrupted_list_exit(__LINE__);
-  /*
-    if (debug)
-    printf("Thread %d, length=%d\n", thread_i, len);
-  */
-
-  for (int i = lower; i < lower + iterations; i++) {
-    const char *key = (elements+i)->key;
-    int list_i = hash(key);
-    acquire_lock(thread_i, list_i);
-    SortedListElement_t *elt = SortedList_lookup(list+list_i, key);
-    // Check for corruption
-    if (elt == NULL || SortedList_delete(elt) == 1)
+  // With --duration, repeat the inserts and deletes until the time is up
+  do {
+    for (int i = lower; i < lower + iterations; i++) {
+      int sampled = sample_every && --countdown == 0;
+      uint64_t start = sampled ? timing_now() : 0;
+      //printf("Sending key: %d\n", (elements+i)->key);
+      // Figure out which sublist
+      int list_i = lock_bucket(thread_i, key_hashes[i], sampled, 0);
+      part_insert(list_i, elements, i);
+      release_lock(thread_i, list_i, 0);
+      if (resize &&
+	  __atomic_add_fetch(&resize_count, 1, __ATOMIC_RELAXED) > (long long)resize * active_lists)
+	split_bucket(thread_i);
+      progress_add(done, 1);
+      if (sampled) {
+	hist_record(op, timing_now() - start);
+	countdown = sample_every;
+      }
+    }
+
+    // The table's length: from the partition counts without any lock,
+    // unless --bucket-stats wants them exact or --check-lists a full walk
+    long long len = opt_check_lists ? getlen(thread_i) :
+      bucket_stats != NULL ? count_exact(thread_i) : count_approx();
+    if (len < 0)
       corrupted_list_exit(__LINE__);
-    release_lock(list_i);
-  }
+    /*
+      if (debug)
+      printf("Thread %d, length=%lld\n", thread_i, len);
+    */
+
+    // Read-heavy workloads: look up our own keys, which must all be there
+    for (int n = 0; n < lookups * iterations; n++) {
+      int i = lower + n % iterations;
+      const char *key = (elements+i)->key;
+      int sampled = sample_every && --countdown == 0;
+      uint64_t start = sampled ? timing_now() : 0;
+      if (!read_lookup(thread_i, key_hashes[i], key, sampled))
+	corrupted_list_exit(__LINE__);
+      progress_add(done, 1);
+      if (sampled) {
+	hist_record(op, timing_now() - start);
+	countdown = sample_every;
+      }
+    }
+
+    for (int i = lower; i < lower + iterations; i++) {
+      const char *key = (elements+i)->key;
+      int sampled = sample_every && --countdown == 0;
+      uint64_t start = sampled ? timing_now() : 0;
+      int list_i = lock_bucket(thread_i, key_hashes[i], sampled, 0);
+      // Check for corruption
+      void *elt = part_find_own(list_i, elements, i);
+      if (elt == NULL || part_delete(list_i, elt, key) == 1)
+	corrupted_list_exit(__LINE__);
+      release_lock(thread_i, list_i, 0);
+      if (resize)
+	__atomic_sub_fetch(&resize_count, 1, __ATOMIC_RELAXED);
+      progress_add(done, 2);
+      // Lookup and delete share a critical section and are timed together
+      if (sampled) {
+	hist_record(op, timing_now() - start);
+	countdown = sample_every;
+      }
+    }
+  } while (duration && !__atomic_load_n(&window_stop, __ATOMIC_ACQUIRE));
 
   //  printf("%d ", SortedList_length(&list));
 
+  // The first thread to finish ends the window in which all were running
+  window_close();
+  if (opt_perf)
+    perf_stop(&perf);
   return 0;
 }
 
@@ -178,6 +555,7 @@ void process_arguments(int argc, char* argv[])
 {
   // Setup argument processing
   int longindex = -1;
+  char* sync_name = NULL;
   num_threads = 1;
   iterations = 1;
   num_lists = 1;
@@ -194,6 +572,18 @@ void process_arguments(int argc, char* argv[])
     {"lists", required_argument, 0, 0},
     {"debug", no_argument, 0, 0},
     {"no-time", no_argument, 0, 0},
+    {"no-csv", no_argument, 0, 0},
+    {"cpus", required_argument, 0, 0},
+    {"placement", required_argument, 0, 0},
+    {"perf", no_argument, 0, 0},
+    {"backoff", required_argument, 0, 0},
+    {"latency", optional_argument, 0, 0},
+    {"duration", required_argument, 0, 0},
+    {"structure", required_argument, 0, 0},
+    {"lookups", required_argument, 0, 0},
+    {"resize", optional_argument, 0, 0},
+    {"bucket-stats", no_argument, 0, 0},
+    {"check-lists", no_argument, 0, 0},
     {0, 0, 0, 0}
   };
 
@@ -237,11 +627,15 @@ void process_arguments(int argc, char* argv[])
       }
     }
     else if (longindex == 3) {
-      sync = *optarg;
-      if (sync != 'm' && sync != 's') {
-	fprintf(stderr, "Invalid sync option: %s\n", optarg);
+      if (strcmp(optarg, "lockfree") == 0)
+	sync = 'f';
+      else if ((lock_kind = lock_parse(optarg)) != -1)
+	sync = 'l';
+      else {
+	fprintf(stderr, "Invalid sync option: %s (expected %s or lockfree)\n", optarg, lock_names);
 	exit(1);
       }
+      sync_name = optarg;
     }
     else if (longindex == 4) {
       num_lists = atoi(optarg);
@@ -256,6 +650,85 @@ void process_arguments(int argc, char* argv[])
     else if (longindex == 6) {
       get_time = 0;
     }
+    else if (longindex == 7) {
+      no_csv = 1;
+    }
+    else if (longindex == 8) {
+      cpus_list = optarg;
+    }
+    else if (longindex == 9) {
+      placement = optarg;
+      if (placement_parse(placement) == -1) {
+	fprintf(stderr, "Invalid placement option: %s (expected %s)\n", optarg, placement_names);
+	exit(1);
+      }
+    }
+    else if (longindex == 10) {
+      opt_perf = 1;
+    }
+    else if (longindex == 11) {
+      if (backoff_parse(optarg) == -1) {
+	fprintf(stderr, "Invalid backoff option: %s (expected none, pause, ttas, exp or yield, "
+		"optionally followed by ,min=N ,max=N ,spins=N)\n", optarg);
+	exit(1);
+      }
+    }
+    else if (longindex == 12) {
+      sample_every = optarg != NULL ? atoi(optarg) : 1;
+      if (sample_every <= 0) {
+	fprintf(stderr, "Invalid latency sampling interval: %s\n", optarg);
+	exit(1);
+      }
+    }
+    else if (longindex == 13) {
+      duration = duration_parse(optarg);
+      if (duration == -1) {
+	fprintf(stderr, "Invalid duration: %s (expected e.g. 5s, 500ms or 2m)\n", optarg);
+	exit(1);
+      }
+    }
+    else if (longindex == 14) {
+      if (strcmp(optarg, "list") == 0)
+	structure = STRUCTURE_LIST;
+      else if (strcmp(optarg, "skiplist") == 0)
+	structure = STRUCTURE_SKIPLIST;
+      else {
+	fprintf(stderr, "Invalid structure option: %s (expected list or skiplist)\n", optarg);
+	exit(1);
+      }
+    }
+    else if (longindex == 15) {
+      lookups = atoi(optarg);
+      if (lookups <= 0) {
+	fprintf(stderr, "Invalid number of lookups specified: %s\n", optarg);
+	exit(1);
+      }
+    }
+    else if (longindex == 16) {
+      resize = optarg != NULL ? atoi(optarg) : RESIZE_LENGTH;
+      if (resize <= 0) {
+	fprintf(stderr, "Invalid average list length for --resize: %s\n", optarg);
+	exit(1);
+      }
+    }
+    else if (longindex == 17) {
+      opt_bucket_stats = 1;
+    }
+    else if (longindex == 18) {
+      opt_check_lists = 1;
+    }
+  }
+  if (sync == 'f' && structure != STRUCTURE_LIST) {
+    fprintf(stderr, "--sync=lockfree is its own list; it does not take --structure\n");
+    exit(1);
+  }
+  if (sync == 'f' && resize) {
+    fprintf(stderr, "--sync=lockfree partitions cannot be split; it does not take --resize\n");
+    exit(1);
+  }
+  if (sync == 'l' && lock_kind == LOCK_SEQLOCK && structure != STRUCTURE_LIST) {
+    fprintf(stderr, "--sync=seqlock reads only support --structure=list\n");
+    exit(1);
   }
   // Create test name
   strcpy(test_name, "list-");
@@ -271,9 +744,33 @@ void process_arguments(int argc, char* argv[])
   strcat(test_name, yield_type);
   strcat(test_name, "-");
   if (sync != '0')
-    strncat(test_name, &sync, 1);
+    strncat(test_name, sync_name, 20);
   else
     strcat(test_name, "none");
+  if (backoff.kind != BACKOFF_NONE) {
+    strcat(test_name, "-");
+    strcat(test_name, backoff.name);
+  }
+  if (structure == STRUCTURE_SKIPLIST)
+    strcat(test_name, "-skiplist");
+  if (lookups) {
+    char suffix[20];
+    sprintf(suffix, "-lookups%d", lookups);
+    strcat(test_name, suffix);
+  }
+  if (resize) {
+    char suffix[20];
+    sprintf(suffix, "-resize%d", resize);
+    strcat(test_name, suffix);
+  }
+
+  // Pinned runs record their placement
+  if (cpus_list != NULL || placement != NULL) {
+    if (placement == NULL)
+      placement = "compact";
+    strcat(test_name, "-");
+    strcat(test_name, placement);
+  }
 
   // Artificial no-time
   //get_time = 0;
@@ -316,17 +813,51 @@ int main(int argc, char* argv[])
   if (debug)
     printf("threads=%d\niterations=%d\n", num_threads, iterations);
 
+  // With --resize, allocate enough partitions up front that the table never
+  // has to move: num_lists doubled until all the elements fit at the
+  // threshold.  Only num_lists are in use to begin with.
+  max_lists = num_lists;
+  if (resize) {
+    while ((long long)max_lists * resize < (long long)num_threads * iterations)
+      max_lists *= 2;
+  }
+  active_lists = num_lists;
+  lists_pow2 = (num_lists & (num_lists - 1)) == 0;
+
   // Initialize sublists
-  list = malloc(sizeof(SortedList_t) * num_lists);
-  for (int i = 0; i < num_lists; i++) {
+  list = malloc(sizeof(SortedList_t) * max_lists);
+  if (list == NULL)
+    error_and_exit2("malloc() failed", errno, __LINE__, 2);
+  for (int i = 0; i < max_lists; i++) {
     list[i].prev = NULL;
     list[i].next = NULL;
     list[i].key = NULL;
   }
+  if (sync == 'f') {
+    // One reclamation record per worker and one for this thread
+    lf_init(num_threads + 1);
+    lf_thread_init(num_threads);
+    lf_lists = malloc(sizeof(struct lf_list) * num_lists);
+    if (lf_lists == NULL)
+      error_and_exit2("malloc() failed", errno, __LINE__, 2);
+    for (int i = 0; i < num_lists; i++)
+      lf_list_init(lf_lists+i);
+  }
+  if (structure == STRUCTURE_SKIPLIST) {
+    skiplists = malloc(sizeof(struct skiplist) * max_lists);
+    if (skiplists == NULL)
+      error_and_exit2("malloc() failed", errno, __LINE__, 2);
+    for (int i = 0; i < max_lists; i++)
+      skiplist_init(skiplists+i);
+  }
+  int c = posix_memalign((void**)&part_counts, CACHE_LINE, sizeof(struct part_count) * max_lists);
+  if (c != 0)
+    error_and_exit2("posix_memalign() failed", c, __LINE__, 2);
+  memset(part_counts, 0, sizeof(struct part_count) * max_lists);
 
   // Check for corruption; don't need mutex here
   for (int i = 0; i < num_lists; i++) {
-    if (SortedList_length(list+i) != 0)
+    if (part_length(i) != 0)
       corrupted_list_exit(__LINE__);
   }
 
@@ -334,35 +865,72 @@ int main(int argc, char* argv[])
   SortedListElement_t elements[num_threads*iterations];
   char key_list[num_threads*iterations][KEYLEN+1];
   init_elements(elements, key_list);
+  all_elements = elements;
+  key_hashes = malloc(sizeof(unsigned) * num_threads * iterations);
+  if (key_hashes == NULL)
+    error_and_exit2("malloc() failed", errno, __LINE__, 2);
+  for (int i = 0; i < num_threads*iterations; i++)
+    key_hashes[i] = hash(elements[i].key);
+  if (structure == STRUCTURE_SKIPLIST) {
+    skip_nodes = malloc(sizeof(struct skiplist_node) * num_threads * iterations);
+    if (skip_nodes == NULL)
+      error_and_exit2("malloc() failed", errno, __LINE__, 2);
+    unsigned seed = 1;
+    for (int i = 0; i < num_threads*iterations; i++)
+      skiplist_node_init(skip_nodes+i, elements[i].key, &seed);
+  }
 
-  // Initialize mutex and locks
-  lock = malloc(sizeof(pthread_mutex_t) * num_lists);
-  spin_lock = malloc(sizeof(int) * num_lists);
-  if (sync == 'm') {
-    for (int i = 0; i < num_lists; i++)
-      pthread_mutex_init(lock+i, NULL);
+  // Initialize locks, and a queue node for every thread and list since
+  // getlen() holds every lock at once
+  locks = malloc(sizeof(struct lock) * max_lists);
+  nodes = malloc(sizeof(struct lock_node*) * num_threads * max_lists);
+  if (locks == NULL || nodes == NULL)
+    error_and_exit2("malloc() failed", errno, __LINE__, 2);
+  if (sync == 'l') {
+    for (int i = 0; i < max_lists; i++)
+      lock_init(locks+i, lock_kind);
+    for (int i = 0; i < num_threads * max_lists; i++)
+      nodes[i] = lock_node_new();
   }
-  else if (sync == 's') {
-    for (int i = 0; i < num_lists; i++)
-      spin_lock[i] = 0;
+
+  // Decide where each thread runs
+  if (placement != NULL) {
+    plan = malloc(num_threads * sizeof(int));
+    if (plan == NULL)
+      error_and_exit2("malloc() failed", errno, __LINE__, 2);
+    topology_plan(cpus_list, placement, num_threads, plan);
+    if (debug) {
+      for (int i = 0; i < num_threads; i++)
+	printf("thread %d -> cpu %d\n", i, plan[i]);
+    }
   }
 
   // Initialize array to count lock time
-  lock_time = malloc(sizeof(long) * num_threads);
-  lock_ops = malloc(sizeof(int) * num_threads);
-  thread_start = malloc(sizeof(struct timespec) * num_threads);
-  thread_end = malloc(sizeof(struct timespec) * num_threads);
+  lock_time = malloc(sizeof(long long) * num_threads);
+  lock_ops = malloc(sizeof(long long) * num_threads);
   for (int i = 0; i < num_threads; i++) {
     lock_time[i] = 0;
     lock_ops[i] = 0;
   }
+  if (get_time || sample_every)
+    timing_calibrate();
 
-  // Get start time
-  struct timespec start;
-  if (clock_gettime(CLOCK_MONOTONIC, &start) == -1)
-    error_and_exit2("clock_gettime() failed", errno, __LINE__, 2);
+  // Per-thread latency histograms
+  if (sample_every) {
+    op_hist = calloc(num_threads, sizeof(struct histogram));
+    wait_hist = calloc(num_threads, sizeof(struct histogram));
+    if (op_hist == NULL || wait_hist == NULL)
+      error_and_exit2("calloc() failed", errno, __LINE__, 2);
+  }
+
+  if (opt_bucket_stats) {
+    bucket_stats = calloc(num_threads, sizeof(struct bucket_stats));
+    if (bucket_stats == NULL)
+      error_and_exit2("calloc() failed", errno, __LINE__, 2);
+  }
 
-  // Create and run threads
+  // Create and run threads; timing starts when all of them are ready
+  window_init(num_threads, duration);
   struct thread_data arg[num_threads];
   pthread_t threads[num_threads];
   for (int i = 0; i < num_threads; i++) {
@@ -373,6 +941,7 @@ int main(int argc, char* argv[])
     if (c != 0)
       error_and_exit2("p_thread_create() failed", c, __LINE__, 2);
   }
+  window_run();
 
   for (int i = 0; i < num_threads; i++) {
     int c = pthread_join(threads[i], NULL);
@@ -381,41 +950,87 @@ int main(int argc, char* argv[])
   }
 
   // Get end time
-  struct timespec end;
-  if (clock_gettime(CLOCK_MONOTONIC, &end) == -1)
-    error_and_exit2("clock_gettime() failed", errno, __LINE__, 2);
-  long long runtime = 1000000000 * (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec);
-  long long ops = num_threads * iterations * 3;
+  long long runtime = window_elapsed();
+  long long ops = progress_total();
+  double throughput = window_throughput();
+  window_destroy();
   long long average = runtime/ops;
   long long avg_lock_wait = 0;
-  int total_lock_ops = 0;
+  long long total_lock_ops = 0;
   for (int i = 0; i < num_threads; i++)
     total_lock_ops += lock_ops[i];
   if (total_lock_ops != 0) {
     long long sum = 0;
     for (int i = 0; i < num_threads; i++)
       sum += lock_time[i];
-    avg_lock_wait = sum/total_lock_ops;
+    avg_lock_wait = sum / ticks_per_ns / total_lock_ops;
   }
 
   // Check for corruption
-  for (int i = 0; i < num_lists; i++) {
-    if (SortedList_length(list+i) != 0)
+  for (int i = 0; i < active_lists; i++) {
+    if (part_length(i) != 0 || part_counts[i].n != 0)
       corrupted_list_exit(__LINE__);
   }
+  if (debug && resize)
+    printf("lists=%d of %d\n", active_lists, max_lists);
+
+  // Sublist lengths from the fullest table any thread saw, on a line of
+  // their own ahead of the results
+  if (opt_bucket_stats) {
+    struct bucket_stats *b = bucket_stats;
+    for (int i = 1; i < num_threads; i++) {
+      if (bucket_stats[i].elements > b->elements)
+	b = bucket_stats + i;
+    }
+    double mean = b->lists ? (double)b->elements / b->lists : 0;
+    double variance = b->lists ? b->sum_sq / b->lists - mean * mean : 0;
+    printf("buckets=%d elements=%d max=%d mean=%.2f variance=%.2f\n", b->lists, b->elements,
+	   b->max, mean, variance);
+  }
 
   // Write to stdout and CSV
-  char output[100];
-  sprintf(output, "%s,%d,%d,%d,%lld,%lld,%lld,%lld\n", test_name, num_threads, iterations, \
-	  num_lists,ops, runtime, average, avg_lock_wait);
+  // The last standard column is the throughput in ops/sec while all threads
+  // ran.  --perf appends the counter totals as extra columns, then --latency
+  // the operation and lock-wait percentiles
+  char output[600];
+  sprintf(output, "%s,%d,%d,%d,%lld,%lld,%lld,%lld,%.0f", test_name, num_threads, iterations, \
+	  num_lists,ops, runtime, average, avg_lock_wait, throughput);
+  if (opt_perf)
+    perf_format(output);
+  if (sample_every) {
+    for (int i = 1; i < num_threads; i++) {
+      hist_merge(op_hist, op_hist + i);
+      hist_merge(wait_hist, wait_hist + i);
+    }
+    hist_format(output, op_hist);
+    hist_format(output, wait_hist);
+  }
+  strcat(output, "\n");
   printf(output);
-  write_csv(output);
+  if (!no_csv)
+    write_csv(output);
 
   // Free memory
   free(lock_time);
-  free(lock);
-  free(spin_lock);
+  if (sync == 'l') {
+    for (int i = 0; i < max_lists; i++)
+      lock_destroy(locks+i);
+    for (int i = 0; i < num_threads * max_lists; i++)
+      lock_node_free(nodes[i]);
+  }
+  free(locks);
+  free(skiplists);
+  if (sync == 'f') {
+    lf_destroy(lf_lists, num_lists);
+    free(lf_lists);
+  }
+  free(skip_nodes);
+  free(nodes);
   free(lock_ops);
-  free(thread_start);
-  free(thread_end);
+  free(op_hist);
+  free(wait_hist);
+  free(key_hashes);
+  free(part_counts);
+  free(bucket_stats);
+  free(plan);
 }
@@ -0,0 +1,261 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sched.h>
+
+#include "SortedList.h"
+#include "lab3_locks.h"
+#include "lab3_lockfree.h"
+
+#define MARKED(p) ((uintptr_t)(p) & 1)
+#define MARK(p) ((struct lf_node*)((uintptr_t)(p) | 1))
+#define UNMARK(p) ((struct lf_node*)((uintptr_t)(p) & ~(uintptr_t)1))
+
+#define RETIRE_THRESHOLD 64  // retired nodes between attempts to advance the epoch
+
+struct lf_thread {
+  volatile int active;  // inside an operation
+  volatile unsigned long epoch;  // global epoch seen on entry
+  struct lf_node* limbo[3];  // retired, by global epoch % 3 at retirement
+  int retired;
+  struct lf_node* pool;  // safe to reuse
+} __attribute__((aligned(CACHE_LINE)));
+
+static volatile unsigned long global_epoch;
+static struct lf_thread* threads;
+static int num_threads;
+static __thread struct lf_thread* self;
+
+static void lf_error(const char* message, int error)
+{
+  fprintf(stderr, "ERROR: %s: %s\n", message, strerror(error));
+  exit(2);
+}
+
+void lf_init(int n)
+{
+  num_threads = n;
+  int c = posix_memalign((void**)&threads, CACHE_LINE, n * sizeof(struct lf_thread));
+  if (c != 0)
+    lf_error("posix_memalign() failed", c);
+  memset(threads, 0, n * sizeof(struct lf_thread));
+}
+
+void lf_thread_init(int id)
+{
+  self = threads + id;
+}
+
+static void free_nodes(struct lf_node* node)
+{
+  while (node != NULL) {
+    struct lf_node* next = node->free_next;
+    free(node);
+    node = next;
+  }
+}
+
+void lf_destroy(struct lf_list* lists, int num_lists)
+{
+  for (int i = 0; i < num_threads; i++) {
+    for (int j = 0; j < 3; j++)
+      free_nodes(threads[i].limbo[j]);
+    free_nodes(threads[i].pool);
+  }
+  for (int i = 0; i < num_lists; i++) {
+    struct lf_node* node = UNMARK(lists[i].head.next);
+    while (node != NULL) {
+      struct lf_node* next = UNMARK(node->next);
+      free(node);
+      node = next;
+    }
+  }
+  free(threads);
+}
+
+// Move a limbo list into the pool
+static void recycle(int i)
+{
+  struct lf_node* node = self->limbo[i];
+  while (node != NULL) {
+    struct lf_node* next = node->free_next;
+    node->free_next = self->pool;
+    self->pool = node;
+    node = next;
+  }
+  self->limbo[i] = NULL;
+}
+
+static void enter()
+{
+  // Announce ourselves before reading the epoch, so try_advance() cannot
+  // move it twice between the read and the announcement.  Until self->epoch
+  // is updated it may hold up an advance, which is harmless.
+  __atomic_store_n(&self->active, 1, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+  // What was retired two or more epochs ago can no longer be referenced.
+  // Retirement tags run up to self->epoch + 1, since the global epoch may
+  // advance once while we are inside an operation.
+  if (epoch >= self->epoch + 3) {
+    for (int i = 0; i < 3; i++)
+      recycle(i);
+  }
+  else if (epoch == self->epoch + 2) {
+    recycle(epoch % 3);
+    recycle((epoch + 1) % 3);
+  }
+  else if (epoch == self->epoch + 1)
+    recycle((epoch + 1) % 3);
+  // Publish the epoch before reading any node
+  __atomic_store_n(&self->epoch, epoch, __ATOMIC_SEQ_CST);
+}
+
+static void leave()
+{
+  __atomic_store_n(&self->active, 0, __ATOMIC_RELEASE);
+}
+
+// Advance the global epoch if every active thread has seen the current one
+static void try_advance()
+{
+  unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < num_threads; i++) {
+    if (__atomic_load_n(&threads[i].active, __ATOMIC_ACQUIRE) &&
+	__atomic_load_n(&threads[i].epoch, __ATOMIC_ACQUIRE) != epoch)
+      return;
+  }
+  __sync_bool_compare_and_swap(&global_epoch, epoch, epoch + 1);
+}
+
+// Tag with the global epoch rather than ours: it may have moved on, and
+// threads that entered since can still reach the node
+static void retire(struct lf_node* node)
+{
+  int i = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE) % 3;
+  node->free_next = self->limbo[i];
+  self->limbo[i] = node;
+  if (++self->retired % RETIRE_THRESHOLD == 0)
+    try_advance();
+}
+
+void lf_list_init(struct lf_list* list)
+{
+  memset(list, 0, sizeof(*list));
+}
+
+/*
+ * Find the first node with a key >= key and its predecessor, with
+ * pred->next == curr, unlinking and retiring marked nodes on the way.
+ * Returns 1 if curr has the key.
+ */
+static int find(struct lf_list* list, const char* key, struct lf_node** pred_out,
+		struct lf_node** curr_out)
+{
+ retry:;
+  struct lf_node* pred = &list->head;
+  struct lf_node* curr = pred->next;
+  while (curr != NULL) {
+    struct lf_node* succ = curr->next;
+    if (MARKED(succ)) {
+      if (!__sync_bool_compare_and_swap(&pred->next, curr, UNMARK(succ)))
+	goto retry;
+      retire(curr);
+      curr = UNMARK(succ);
+      continue;
+    }
+    if (strcmp(curr->key, key) >= 0)
+      break;
+    pred = curr;
+    curr = succ;
+  }
+  *pred_out = pred;
+  *curr_out = curr;
+  return curr != NULL && strcmp(curr->key, key) == 0;
+}
+
+void lf_insert(struct lf_list* list, const char* key)
+{
+  struct lf_node* node = self->pool;
+  if (node != NULL)
+    self->pool = node->free_next;
+  else if ((node = malloc(sizeof(*node))) == NULL)
+    lf_error("malloc() failed", ENOMEM);
+  node->key = key;
+
+  enter();
+  struct lf_node *pred, *curr;
+  do {
+    find(list, key, &pred, &curr);
+    node->next = curr;
+    if (opt_yield & INSERT_YIELD)
+      sched_yield();
+  } while (!__sync_bool_compare_and_swap(&pred->next, curr, node));
+  leave();
+}
+
+struct lf_node* lf_lookup(struct lf_list* list, const char* key)
+{
+  enter();
+  struct lf_node* curr = UNMARK(list->head.next);
+  while (curr != NULL) {
+    if (opt_yield & LOOKUP_YIELD)
+      sched_yield();
+    int cmp = strcmp(curr->key, key);
+    if (cmp > 0 || (cmp == 0 && !MARKED(curr->next)))
+      break;
+    curr = UNMARK(curr->next);
+  }
+  if (curr != NULL && strcmp(curr->key, key) != 0)
+    curr = NULL;
+  leave();
+  return curr;
+}
+
+int lf_delete(struct lf_list* list, const char* key)
+{
+  enter();
+  struct lf_node *pred, *curr;
+  while (1) {
+    if (!find(list, key, &pred, &curr)) {
+      leave();
+      return 1;
+    }
+    struct lf_node* succ = curr->next;
+    if (MARKED(succ))
+      continue;
+    // Marking the node is the deletion; unlinking it is cleanup
+    if (!__sync_bool_compare_and_swap(&curr->next, succ, MARK(succ)))
+      continue;
+    if (opt_yield & DELETE_YIELD)
+      sched_yield();
+    if (__sync_bool_compare_and_swap(&pred->next, curr, succ))
+      retire(curr);
+    else
+      find(list, key, &pred, &curr);
+    leave();
+    return 0;
+  }
+}
+
+int lf_length(struct lf_list* list)
+{
+  enter();
+  int length = 0;
+  const char* last = NULL;
+  for (struct lf_node* curr = UNMARK(list->head.next); curr != NULL; curr = UNMARK(curr->next)) {
+    if (MARKED(curr->next))
+      continue;
+    if (last != NULL && strcmp(last, curr->key) > 0) {
+      leave();
+      return -1;
+    }
+    last = curr->key;
+    length++;
+  }
+  leave();
+  return length;
+}
@@ -0,0 +1,47 @@
+/*
+ * Lock-free sorted list for lab3_list (--sync=lockfree), after Harris, "A
+ * Pragmatic Implementation of Non-Blocking Linked-Lists": a node is deleted
+ * by first marking the low bit of its next pointer, then unlinking it, and
+ * any traversal that meets a marked node helps unlink it.
+ *
+ * Unlinked nodes are reclaimed with epoch-based reclamation.  Every operation
+ * runs inside an epoch; a node retired in epoch e is recycled once the global
+ * epoch reaches e + 2, since by then no thread can still hold a pointer to
+ * it.  Recycled nodes go to a per-thread pool that lf_insert() draws from
+ * before calling malloc().
+ */
+#ifndef LAB3_LOCKFREE_H
+#define LAB3_LOCKFREE_H
+
+struct lf_node {
+  const char* key;
+  struct lf_node* volatile next;  // low bit set once the node is deleted
+  struct lf_node* free_next;  // limbo or pool list
+};
+
+struct lf_list {
+  struct lf_node head;  // sentinel, key unused
+};
+
+// Set up reclamation for n threads; each calls lf_thread_init() with its id
+void lf_init(int n);
+void lf_thread_init(int id);
+
+// Free every node still held, once the threads are done
+void lf_destroy(struct lf_list* lists, int num_lists);
+
+void lf_list_init(struct lf_list* list);
+
+void lf_insert(struct lf_list* list, const char* key);
+
+// A node with the key, or NULL; only good for comparing against NULL, since
+// it may be reclaimed as soon as this returns
+struct lf_node* lf_lookup(struct lf_list* list, const char* key);
+
+// Delete a node with the key; returns 1 if there is none
+int lf_delete(struct lf_list* list, const char* key);
+
+// Number of nodes not deleted, or -1 if the list is out of order
+int lf_length(struct lf_list* list);
+
+#endif
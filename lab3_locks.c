@@ -0,0 +1,403 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "lab3_locks.h"
+#include "lab3_timing.h"
+
+const char* lock_names = "m, s, pspin, ticket, mcs, clh, futex, adaptive, rw, seqlock";
+
+struct backoff_policy backoff = {BACKOFF_NONE, "none", 4, 1024, 100};
+
+// Indexed by enum backoff_kind
+static const char* backoff_names[] = {"none", "pause", "ttas", "exp", "yield"};
+
+int backoff_parse(const char* spec)
+{
+  char* copy = strdup(spec);
+  char* save;
+  char* tok = strtok_r(copy, ",", &save);
+  int ok = 0;
+  for (int i = BACKOFF_NONE; tok != NULL && i <= BACKOFF_YIELD; i++) {
+    if (strcmp(tok, backoff_names[i]) == 0) {
+      backoff.kind = i;
+      backoff.name = backoff_names[i];
+      ok = 1;
+    }
+  }
+
+  while (ok && (tok = strtok_r(NULL, ",", &save)) != NULL) {
+    int value = atoi(strchr(tok, '=') != NULL ? strchr(tok, '=') + 1 : "0");
+    if (value <= 0)
+      ok = 0;
+    else if (strncmp(tok, "min=", 4) == 0)
+      backoff.min_delay = value;
+    else if (strncmp(tok, "max=", 4) == 0)
+      backoff.max_delay = value;
+    else if (strncmp(tok, "spins=", 6) == 0)
+      backoff.spins = value;
+    else
+      ok = 0;
+  }
+  free(copy);
+  if (backoff.max_delay < backoff.min_delay)
+    ok = 0;
+  return ok ? 0 : -1;
+}
+
+// xorshift; one state per thread, seeded from its address
+static __thread unsigned jitter_state;
+
+static unsigned jitter()
+{
+  if (jitter_state == 0)
+    jitter_state = (unsigned)(unsigned long)&jitter_state | 1;
+  jitter_state ^= jitter_state << 13;
+  jitter_state ^= jitter_state >> 17;
+  jitter_state ^= jitter_state << 5;
+  return jitter_state;
+}
+
+void backoff_wait(struct backoff_state* state)
+{
+  switch (backoff.kind) {
+  case BACKOFF_NONE:
+    break;
+  case BACKOFF_PAUSE:
+  case BACKOFF_TTAS:
+    cpu_relax();
+    break;
+  case BACKOFF_EXP: {
+    int wait = state->delay / 2 + jitter() % (state->delay / 2 + 1);
+    for (int i = 0; i < wait; i++)
+      cpu_relax();
+    if (state->delay < backoff.max_delay)
+      state->delay = state->delay * 2 < backoff.max_delay ? state->delay * 2 : backoff.max_delay;
+    break;
+  }
+  case BACKOFF_YIELD:
+    if (++state->spins < backoff.spins)
+      cpu_relax();
+    else {
+      state->spins = 0;
+      sched_yield();
+    }
+    break;
+  }
+}
+
+int lock_parse(const char* name)
+{
+  if (strcmp(name, "m") == 0)
+    return LOCK_MUTEX;
+  else if (strcmp(name, "s") == 0)
+    return LOCK_TAS;
+  else if (strcmp(name, "pspin") == 0)
+    return LOCK_PTHREAD_SPIN;
+  else if (strcmp(name, "ticket") == 0)
+    return LOCK_TICKET;
+  else if (strcmp(name, "mcs") == 0)
+    return LOCK_MCS;
+  else if (strcmp(name, "clh") == 0)
+    return LOCK_CLH;
+  else if (strcmp(name, "futex") == 0)
+    return LOCK_FUTEX;
+  else if (strcmp(name, "adaptive") == 0)
+    return LOCK_ADAPTIVE;
+  else if (strcmp(name, "rw") == 0)
+    return LOCK_RW;
+  else if (strcmp(name, "seqlock") == 0)
+    return LOCK_SEQLOCK;
+  return -1;
+}
+
+static void lock_error(const char* message, int error)
+{
+  fprintf(stderr, "ERROR: %s: %s\n", message, strerror(error));
+  exit(2);
+}
+
+struct lock_node* lock_node_new()
+{
+  struct lock_node* node;
+  int c = posix_memalign((void**)&node, CACHE_LINE, sizeof(*node));
+  if (c != 0)
+    lock_error("posix_memalign() failed", c);
+  node->next = NULL;
+  node->pred = NULL;
+  node->locked = 0;
+  return node;
+}
+
+void lock_node_free(struct lock_node* node)
+{
+  free(node);
+}
+
+/*
+ * Adaptive lock: the futex mutex below, but a waiter first spins for up to
+ * spin_budget ticks.  The holder times one hold in ADAPTIVE_SAMPLE; when
+ * spinning gets the lock the budget moves toward twice the mean hold, and
+ * when it does not (typically because the holder was preempted, as happens
+ * once threads outnumber CPUs) the budget is halved and the waiter parks.
+ * The budget never exceeds roughly the cost of parking and waking, beyond
+ * which spinning cannot win.
+ */
+#define ADAPTIVE_MIN_SPIN 64
+#define ADAPTIVE_MAX_SPIN 16384
+#define ADAPTIVE_SAMPLE 8
+
+void lock_init(struct lock* lock, enum lock_kind kind)
+{
+  memset(lock, 0, sizeof(*lock));
+  lock->kind = kind;
+  if (kind == LOCK_MUTEX) {
+    int c = pthread_mutex_init(&lock->mutex, NULL);
+    if (c != 0)
+      lock_error("pthread_mutex_init() failed", c);
+  }
+  else if (kind == LOCK_PTHREAD_SPIN) {
+    int c = pthread_spin_init(&lock->pthread_spin, PTHREAD_PROCESS_PRIVATE);
+    if (c != 0)
+      lock_error("pthread_spin_init() failed", c);
+  }
+  else if (kind == LOCK_CLH)
+    lock->tail = lock_node_new();  // unlocked dummy node
+  else if (kind == LOCK_ADAPTIVE)
+    lock->spin_budget = ADAPTIVE_MAX_SPIN / 4;
+  else if (kind == LOCK_RW) {
+    int c = pthread_rwlock_init(&lock->rwlock, NULL);
+    if (c != 0)
+      lock_error("pthread_rwlock_init() failed", c);
+  }
+}
+
+void lock_destroy(struct lock* lock)
+{
+  if (lock->kind == LOCK_MUTEX)
+    pthread_mutex_destroy(&lock->mutex);
+  else if (lock->kind == LOCK_PTHREAD_SPIN)
+    pthread_spin_destroy(&lock->pthread_spin);
+  else if (lock->kind == LOCK_CLH)
+    lock_node_free(lock->tail);
+  else if (lock->kind == LOCK_RW)
+    pthread_rwlock_destroy(&lock->rwlock);
+}
+
+static long futex(volatile int* addr, int op, int value)
+{
+  return syscall(SYS_futex, addr, op, value, NULL, NULL, 0);
+}
+
+/*
+ * Futex mutex after Drepper, "Futexes Are Tricky": word is 0 when free, 1
+ * when held and 2 when held with possible waiters, so an uncontended
+ * lock/unlock pair never enters the kernel.
+ */
+static void futex_lock(volatile int* word)
+{
+  int c = __sync_val_compare_and_swap(word, 0, 1);
+  if (c == 0)
+    return;
+  if (c != 2)
+    c = __atomic_exchange_n(word, 2, __ATOMIC_ACQUIRE);
+  while (c != 0) {
+    futex(word, FUTEX_WAIT_PRIVATE, 2);
+    c = __atomic_exchange_n(word, 2, __ATOMIC_ACQUIRE);
+  }
+}
+
+static void futex_unlock(volatile int* word)
+{
+  if (__atomic_fetch_sub(word, 1, __ATOMIC_RELEASE) != 1) {
+    __atomic_store_n(word, 0, __ATOMIC_RELEASE);
+    futex(word, FUTEX_WAKE_PRIVATE, 1);
+  }
+}
+
+static void adaptive_lock(struct lock* lock)
+{
+  if (__sync_val_compare_and_swap(&lock->word, 0, 1) != 0) {
+    long budget = __atomic_load_n(&lock->spin_budget, __ATOMIC_RELAXED);
+    uint64_t start = timing_now();
+    int acquired = 0;
+    while (timing_now() - start < (uint64_t)budget) {
+      if (__atomic_load_n(&lock->word, __ATOMIC_RELAXED) == 0 &&
+	  __sync_val_compare_and_swap(&lock->word, 0, 1) == 0) {
+	acquired = 1;
+	break;
+      }
+      cpu_relax();
+    }
+    if (!acquired) {
+      long less = budget / 2 > ADAPTIVE_MIN_SPIN ? budget / 2 : ADAPTIVE_MIN_SPIN;
+      __atomic_store_n(&lock->spin_budget, less, __ATOMIC_RELAXED);
+      futex_lock(&lock->word);
+    }
+    else if (lock->hold_avg != 0) {
+      // hold_avg is only written under the lock, which we now hold
+      long target = 2 * lock->hold_avg;
+      if (target < ADAPTIVE_MIN_SPIN)
+	target = ADAPTIVE_MIN_SPIN;
+      else if (target > ADAPTIVE_MAX_SPIN)
+	target = ADAPTIVE_MAX_SPIN;
+      __atomic_store_n(&lock->spin_budget, budget + (target - budget) / 8, __ATOMIC_RELAXED);
+    }
+  }
+  if (++lock->holds % ADAPTIVE_SAMPLE == 0)
+    lock->hold_start = timing_now();
+}
+
+static void adaptive_unlock(struct lock* lock)
+{
+  if (lock->holds % ADAPTIVE_SAMPLE == 0) {
+    long long hold = timing_now() - lock->hold_start;
+    lock->hold_avg = lock->hold_avg == 0 ? hold : lock->hold_avg + (hold - lock->hold_avg) / 8;
+  }
+  futex_unlock(&lock->word);
+}
+
+void lock_acquire(struct lock* lock, struct lock_node** node)
+{
+  switch (lock->kind) {
+  case LOCK_MUTEX:
+    pthread_mutex_lock(&lock->mutex);
+    break;
+  case LOCK_TAS: {
+    struct backoff_state state;
+    backoff_reset(&state);
+    while (__sync_lock_test_and_set(&lock->word, 1)) {
+      if (backoff.kind == BACKOFF_TTAS) {
+	while (__atomic_load_n(&lock->word, __ATOMIC_RELAXED))
+	  cpu_relax();
+      }
+      else
+	backoff_wait(&state);
+    }
+    break;
+  }
+  case LOCK_PTHREAD_SPIN:
+    pthread_spin_lock(&lock->pthread_spin);
+    break;
+  case LOCK_TICKET: {
+    unsigned ticket = __atomic_fetch_add(&lock->next_ticket, 1, __ATOMIC_RELAXED);
+    while (__atomic_load_n(&lock->now_serving, __ATOMIC_ACQUIRE) != ticket)
+      cpu_relax();
+    break;
+  }
+  case LOCK_MCS: {
+    struct lock_node* me = *node;
+    me->next = NULL;
+    me->locked = 1;
+    struct lock_node* pred = __atomic_exchange_n(&lock->tail, me, __ATOMIC_ACQ_REL);
+    if (pred != NULL) {
+      __atomic_store_n(&pred->next, me, __ATOMIC_RELEASE);
+      while (__atomic_load_n(&me->locked, __ATOMIC_ACQUIRE))
+	cpu_relax();
+    }
+    break;
+  }
+  case LOCK_CLH: {
+    struct lock_node* me = *node;
+    me->locked = 1;
+    me->pred = __atomic_exchange_n(&lock->tail, me, __ATOMIC_ACQ_REL);
+    while (__atomic_load_n(&me->pred->locked, __ATOMIC_ACQUIRE))
+      cpu_relax();
+    break;
+  }
+  case LOCK_FUTEX:
+    futex_lock(&lock->word);
+    break;
+  case LOCK_ADAPTIVE:
+    adaptive_lock(lock);
+    break;
+  case LOCK_RW:
+    pthread_rwlock_wrlock(&lock->rwlock);
+    break;
+  case LOCK_SEQLOCK:
+    // Writers exclude each other with the futex mutex, then make seq odd;
+    // the fence keeps the data writes after it
+    futex_lock(&lock->word);
+    __atomic_store_n(&lock->seq, lock->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    break;
+  }
+}
+
+void lock_release(struct lock* lock, struct lock_node** node)
+{
+  switch (lock->kind) {
+  case LOCK_MUTEX:
+    pthread_mutex_unlock(&lock->mutex);
+    break;
+  case LOCK_TAS:
+    __sync_lock_release(&lock->word);
+    break;
+  case LOCK_PTHREAD_SPIN:
+    pthread_spin_unlock(&lock->pthread_spin);
+    break;
+  case LOCK_TICKET:
+    __atomic_store_n(&lock->now_serving, lock->now_serving + 1, __ATOMIC_RELEASE);
+    break;
+  case LOCK_MCS: {
+    struct lock_node* me = *node;
+    struct lock_node* next = __atomic_load_n(&me->next, __ATOMIC_ACQUIRE);
+    if (next == NULL) {
+      // No known successor: try to swing the tail back to empty
+      struct lock_node* expected = me;
+      if (__atomic_compare_exchange_n(&lock->tail, &expected, NULL, 0,
+				      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	return;
+      // A successor is linking itself in
+      while ((next = __atomic_load_n(&me->next, __ATOMIC_ACQUIRE)) == NULL)
+	cpu_relax();
+    }
+    __atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+    break;
+  }
+  case LOCK_CLH: {
+    // Our node now belongs to the successor; take over the predecessor's
+    struct lock_node* me = *node;
+    struct lock_node* pred = me->pred;
+    __atomic_store_n(&me->locked, 0, __ATOMIC_RELEASE);
+    *node = pred;
+    break;
+  }
+  case LOCK_FUTEX:
+    futex_unlock(&lock->word);
+    break;
+  case LOCK_ADAPTIVE:
+    adaptive_unlock(lock);
+    break;
+  case LOCK_RW:
+    pthread_rwlock_unlock(&lock->rwlock);
+    break;
+  case LOCK_SEQLOCK:
+    __atomic_store_n(&lock->seq, lock->seq + 1, __ATOMIC_RELEASE);
+    futex_unlock(&lock->word);
+    break;
+  }
+}
+
+void lock_acquire_shared(struct lock* lock, struct lock_node** node)
+{
+  if (lock->kind == LOCK_RW)
+    pthread_rwlock_rdlock(&lock->rwlock);
+  else
+    lock_acquire(lock, node);
+}
+
+void lock_release_shared(struct lock* lock, struct lock_node** node)
+{
+  if (lock->kind == LOCK_RW)
+    pthread_rwlock_unlock(&lock->rwlock);
+  else
+    lock_release(lock, node);
+}
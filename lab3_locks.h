@@ -0,0 +1,160 @@
+/*
+ * Lock suite for the lab3 benchmarks: one interface over a pthread mutex, a
+ * test-and-set spin lock, pthread_spinlock_t, a ticket lock, MCS and CLH
+ * queue locks, a futex-based mutex, an adaptive spin-then-park lock, a
+ * pthread_rwlock_t and a seqlock, so the benchmarks can swap locks from
+ * --sync without changing the code under test.
+ */
+#ifndef LAB3_LOCKS_H
+#define LAB3_LOCKS_H
+
+#include <pthread.h>
+
+#define CACHE_LINE 64
+
+enum lock_kind {
+  LOCK_MUTEX,
+  LOCK_TAS,
+  LOCK_PTHREAD_SPIN,
+  LOCK_TICKET,
+  LOCK_MCS,
+  LOCK_CLH,
+  LOCK_FUTEX,
+  LOCK_ADAPTIVE,
+  LOCK_RW,
+  LOCK_SEQLOCK
+};
+
+/*
+ * Queue node for MCS and CLH.  Every thread needs its own node per lock it
+ * may hold at the same time.  CLH hands a thread its predecessor's node on
+ * release, so the caller holds a pointer that lock_release() may change.
+ */
+struct lock_node {
+  struct lock_node* volatile next;  // MCS: successor waiting on us
+  struct lock_node* pred;           // CLH: node we spun on
+  volatile int locked;
+} __attribute__((aligned(CACHE_LINE)));
+
+struct lock {
+  enum lock_kind kind;
+  pthread_mutex_t mutex;
+  pthread_spinlock_t pthread_spin;
+  pthread_rwlock_t rwlock;
+  volatile int word;                // TAS flag or futex state
+  volatile unsigned seq;            // seqlock: odd while a writer holds it
+  volatile unsigned next_ticket;
+  volatile unsigned now_serving;
+  struct lock_node* volatile tail;  // MCS and CLH queue
+  // Adaptive lock: how long a waiter spins before parking on the futex, and
+  // the holder's running mean hold time, both in TSC ticks
+  volatile long spin_budget;
+  long long hold_avg;
+  unsigned long long hold_start;
+  unsigned holds;
+};
+
+// Spin-wait hint for busy loops
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+/*
+ * Backoff between failed attempts of the test-and-set lock and of CAS loops
+ * (--backoff=POLICY[,min=N][,max=N][,spins=N]):
+ *   none   retry at once
+ *   pause  one cpu_relax() per retry
+ *   ttas   test-and-test-and-set: spin reading the word until it looks free
+ *          (CAS loops re-read after one cpu_relax())
+ *   exp    bounded exponential backoff with jitter: a random wait in
+ *          [delay/2, delay] cpu_relax() calls, delay doubling from min to max
+ *   yield  spin spins times with cpu_relax(), then sched_yield()
+ */
+enum backoff_kind {
+  BACKOFF_NONE,
+  BACKOFF_PAUSE,
+  BACKOFF_TTAS,
+  BACKOFF_EXP,
+  BACKOFF_YIELD
+};
+
+struct backoff_policy {
+  enum backoff_kind kind;
+  const char* name;
+  int min_delay;
+  int max_delay;
+  int spins;
+};
+
+// Policy for every lock and CAS loop in the process
+extern struct backoff_policy backoff;
+
+// Per-attempt state; reset with backoff_reset() before each acquisition
+struct backoff_state {
+  int delay;
+  int spins;
+};
+
+// Set backoff from a --backoff argument; returns -1 if it is invalid
+int backoff_parse(const char* spec);
+
+static inline void backoff_reset(struct backoff_state* state)
+{
+  state->delay = backoff.min_delay;
+  state->spins = 0;
+}
+
+// Wait after a failed attempt, as the policy says
+void backoff_wait(struct backoff_state* state);
+
+// Returns the lock kind named by name (see lock_names), or -1
+int lock_parse(const char* name);
+
+// Names accepted by lock_parse(), for usage messages
+extern const char* lock_names;
+
+void lock_init(struct lock* lock, enum lock_kind kind);
+void lock_destroy(struct lock* lock);
+
+// Allocate or free a queue node; any lock kind accepts one
+struct lock_node* lock_node_new();
+void lock_node_free(struct lock_node* node);
+
+void lock_acquire(struct lock* lock, struct lock_node** node);
+void lock_release(struct lock* lock, struct lock_node** node);
+
+// For readers: shared for rw, exclusive for every other kind
+void lock_acquire_shared(struct lock* lock, struct lock_node** node);
+void lock_release_shared(struct lock* lock, struct lock_node** node);
+
+/*
+ * Optimistic seqlock readers take no lock:
+ *   do { seq = lock_read_begin(lock); ...read... } while (!lock_read_validate(lock, seq));
+ * Writers take the lock with lock_acquire(), which makes seq odd until
+ * lock_release().  What is read may be inconsistent until validated.  An
+ * odd seq means a writer is active and never validates; rather than spin on
+ * it (the writer may be preempted), callers can check lock_read_busy() and
+ * fall back to the lock after a few tries.
+ */
+static inline unsigned lock_read_begin(struct lock* lock)
+{
+  return __atomic_load_n(&lock->seq, __ATOMIC_ACQUIRE);
+}
+
+static inline int lock_read_busy(unsigned seq)
+{
+  return seq & 1;
+}
+
+static inline int lock_read_validate(struct lock* lock, unsigned seq)
+{
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return !(seq & 1) && __atomic_load_n(&lock->seq, __ATOMIC_RELAXED) == seq;
+}
+
+#endif
@@ -0,0 +1,91 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "lab3_perf.h"
+
+const char* perf_names[PERF_COUNTERS] = {
+  "cycles", "instructions", "cache_misses", "llc_misses", "context_switches"
+};
+
+static long long totals[PERF_COUNTERS];
+static int unavailable[PERF_COUNTERS];
+static int warned;
+
+static int perf_open(int counter)
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  switch (counter) {
+  case PERF_CYCLES:
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    break;
+  case PERF_INSTRUCTIONS:
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    break;
+  case PERF_CACHE_MISSES:
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    break;
+  case PERF_LLC_MISSES:
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    break;
+  case PERF_CONTEXT_SWITCHES:
+    // Context switches happen in the kernel
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.config = PERF_COUNT_SW_CONTEXT_SWITCHES;
+    attr.exclude_kernel = 0;
+    break;
+  }
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+void perf_start(struct perf_thread* perf)
+{
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    perf->fd[i] = perf_open(i);
+    if (perf->fd[i] == -1 && __sync_lock_test_and_set(&warned, 1) == 0)
+      fprintf(stderr, "WARNING: perf_event_open(%s) failed: %s; reporting -1\n",
+	      perf_names[i], strerror(errno));
+  }
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    if (perf->fd[i] != -1)
+      ioctl(perf->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+  }
+}
+
+void perf_stop(struct perf_thread* perf)
+{
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    if (perf->fd[i] != -1)
+      ioctl(perf->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+  }
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    long long value;
+    if (perf->fd[i] == -1 || read(perf->fd[i], &value, sizeof(value)) != sizeof(value))
+      __atomic_store_n(&unavailable[i], 1, __ATOMIC_RELAXED);
+    else
+      __atomic_fetch_add(&totals[i], value, __ATOMIC_RELAXED);
+    if (perf->fd[i] != -1)
+      close(perf->fd[i]);
+  }
+}
+
+void perf_format(char* buf)
+{
+  for (int i = 0; i < PERF_COUNTERS; i++)
+    sprintf(buf + strlen(buf), ",%lld", unavailable[i] ? -1 : totals[i]);
+}
@@ -0,0 +1,37 @@
+/*
+ * Hardware counters for the lab3 benchmarks (--perf).  Each thread opens its
+ * own counters with perf_event_open() for the calling thread only, so they
+ * count the benchmark work and not the setup, and adds them to process-wide
+ * totals when it finishes.  A counter the kernel or the machine does not
+ * provide (no PMU in a VM, perf_event_paranoid, ...) is reported as -1
+ * instead of failing the run.
+ */
+#ifndef LAB3_PERF_H
+#define LAB3_PERF_H
+
+enum {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_CACHE_MISSES,
+  PERF_LLC_MISSES,
+  PERF_CONTEXT_SWITCHES,
+  PERF_COUNTERS
+};
+
+// Column names in the order perf_format() prints the totals
+extern const char* perf_names[PERF_COUNTERS];
+
+struct perf_thread {
+  int fd[PERF_COUNTERS];
+};
+
+// Open and start the calling thread's counters
+void perf_start(struct perf_thread* perf);
+
+// Stop the calling thread's counters and add them to the totals
+void perf_stop(struct perf_thread* perf);
+
+// Append ",cycles,instructions,..." totals to buf (-1 where unavailable)
+void perf_format(char* buf);
+
+#endif
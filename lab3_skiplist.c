@@ -0,0 +1,100 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "SortedList.h"
+#include "lab3_skiplist.h"
+
+void skiplist_init(struct skiplist* list)
+{
+  memset(list, 0, sizeof(*list));
+  list->head.height = SKIPLIST_MAX_LEVEL;
+  list->level = 1;
+}
+
+void skiplist_node_init(struct skiplist_node* node, const char* key, unsigned* seed)
+{
+  node->key = key;
+  node->height = 1;
+  while (node->height < SKIPLIST_MAX_LEVEL && rand_r(seed) % 4 == 0)
+    node->height++;
+  for (int i = 0; i < node->height; i++)
+    node->next[i] = NULL;
+}
+
+// Fill update[] with the last node before key on every level in use
+static void find_preds(struct skiplist* list, const char* key,
+		       struct skiplist_node* update[SKIPLIST_MAX_LEVEL])
+{
+  struct skiplist_node* x = &list->head;
+  for (int i = list->level - 1; i >= 0; i--) {
+    while (x->next[i] != NULL && strcmp(x->next[i]->key, key) < 0)
+      x = x->next[i];
+    update[i] = x;
+  }
+}
+
+void skiplist_insert(struct skiplist* list, struct skiplist_node* node)
+{
+  struct skiplist_node* update[SKIPLIST_MAX_LEVEL];
+  find_preds(list, node->key, update);
+  for (int i = list->level; i < node->height; i++)
+    update[i] = &list->head;
+  if (opt_yield & INSERT_YIELD)
+    sched_yield();
+  for (int i = 0; i < node->height; i++) {
+    node->next[i] = update[i]->next[i];
+    update[i]->next[i] = node;
+  }
+  if (node->height > list->level)
+    list->level = node->height;
+}
+
+struct skiplist_node* skiplist_lookup(struct skiplist* list, const char* key)
+{
+  struct skiplist_node* x = &list->head;
+  for (int i = list->level - 1; i >= 0; i--) {
+    if (opt_yield & LOOKUP_YIELD)
+      sched_yield();
+    while (x->next[i] != NULL && strcmp(x->next[i]->key, key) < 0)
+      x = x->next[i];
+  }
+  x = x->next[0];
+  return x != NULL && strcmp(x->key, key) == 0 ? x : NULL;
+}
+
+int skiplist_delete(struct skiplist* list, struct skiplist_node* node)
+{
+  struct skiplist_node* update[SKIPLIST_MAX_LEVEL];
+  find_preds(list, node->key, update);
+  if (node->height > list->level)
+    return 1;
+  // Keys may repeat: step over equal keys to the node itself
+  for (int i = 0; i < node->height; i++) {
+    struct skiplist_node* x = update[i];
+    while (x->next[i] != NULL && x->next[i] != node && strcmp(x->next[i]->key, node->key) == 0)
+      x = x->next[i];
+    if (x->next[i] != node)
+      return 1;
+    update[i] = x;
+  }
+  if (opt_yield & DELETE_YIELD)
+    sched_yield();
+  for (int i = 0; i < node->height; i++)
+    update[i]->next[i] = node->next[i];
+  while (list->level > 1 && list->head.next[list->level - 1] == NULL)
+    list->level--;
+  return 0;
+}
+
+int skiplist_length(struct skiplist* list)
+{
+  int length = 0;
+  for (struct skiplist_node* x = list->head.next[0]; x != NULL; x = x->next[0]) {
+    if (x->next[0] != NULL && strcmp(x->key, x->next[0]->key) > 0)
+      return -1;
+    length++;
+  }
+  return length;
+}
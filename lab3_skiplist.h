@@ -0,0 +1,41 @@
+/*
+ * Skip list backend for the lab3_list partitions (--structure=skiplist):
+ * the same insert/lookup/delete/length operations as SortedList.h, in
+ * O(log n) expected time instead of a linear walk.  Node heights are drawn
+ * once, when the node is initialized, with p = 1/4 per extra level, so the
+ * operations themselves use no random numbers.  Like SortedList.h it does
+ * no locking of its own, and it honours the same opt_yield flags.
+ */
+#ifndef LAB3_SKIPLIST_H
+#define LAB3_SKIPLIST_H
+
+#define SKIPLIST_MAX_LEVEL 16
+
+struct skiplist_node {
+  const char* key;
+  int height;
+  struct skiplist_node* next[SKIPLIST_MAX_LEVEL];
+};
+
+struct skiplist {
+  struct skiplist_node head;  // key unused, full height
+  int level;  // levels in use
+};
+
+void skiplist_init(struct skiplist* list);
+
+// Set the node's key and draw its height from *seed
+void skiplist_node_init(struct skiplist_node* node, const char* key, unsigned* seed);
+
+void skiplist_insert(struct skiplist* list, struct skiplist_node* node);
+
+// First node with the key, or NULL
+struct skiplist_node* skiplist_lookup(struct skiplist* list, const char* key);
+
+// Unlink the node; returns 1 if it is not in the list (corruption)
+int skiplist_delete(struct skiplist* list, struct skiplist_node* node);
+
+// Number of nodes, or -1 if the bottom level is out of order
+int skiplist_length(struct skiplist* list);
+
+#endif
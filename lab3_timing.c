@@ -0,0 +1,224 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "lab3_timing.h"
+
+double ticks_per_ns = 1.0;
+
+static uint64_t monotonic_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void timing_calibrate()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  // Count ticks over 20ms of wall time
+  uint64_t start_ns = monotonic_ns(), start_ticks = timing_now();
+  uint64_t now_ns;
+  while ((now_ns = monotonic_ns()) - start_ns < 20000000)
+    ;
+  ticks_per_ns = (double)(timing_now() - start_ticks) / (now_ns - start_ns);
+#endif
+}
+
+void hist_merge(struct histogram* dst, const struct histogram* src)
+{
+  for (int i = 0; i < HIST_BUCKETS; i++)
+    dst->counts[i] += src->counts[i];
+  dst->total += src->total;
+  if (src->max > dst->max)
+    dst->max = src->max;
+}
+
+// Midpoint of a bucket, in ticks
+static double bucket_value(int i)
+{
+  if (i < (1 << HIST_SUB_BITS))
+    return i;
+  int shift = (i >> HIST_SUB_BITS) - 1;
+  uint64_t low = (uint64_t)((1 << HIST_SUB_BITS) + (i & ((1 << HIST_SUB_BITS) - 1))) << shift;
+  return low + ((1ULL << shift) - 1) / 2.0;
+}
+
+double hist_percentile(const struct histogram* h, double q)
+{
+  if (h->total == 0)
+    return 0;
+  uint64_t rank = (uint64_t)(q * h->total + 0.5);
+  if (rank == 0)
+    rank = 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen >= rank) {
+      double value = bucket_value(i);
+      return (value > h->max ? h->max : value) / ticks_per_ns;
+    }
+  }
+  return h->max / ticks_per_ns;
+}
+
+void hist_format(char* buf, const struct histogram* h)
+{
+  sprintf(buf + strlen(buf), ",%.0f,%.0f,%.0f,%.0f,%.0f", hist_percentile(h, 0.5),
+	  hist_percentile(h, 0.9), hist_percentile(h, 0.99), hist_percentile(h, 0.999),
+	  h->max / ticks_per_ns);
+}
+
+struct thread_progress* progress;
+volatile int window_stop;
+
+static pthread_barrier_t start_barrier;
+static int workers;
+static long long duration;
+static pthread_mutex_t window_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t run_start;  // first thread out of the barrier
+static uint64_t window_start, window_end;  // last worker out, first worker done
+static long long window_start_ops, window_ops;  // progress_total() at each
+static int window_closed;
+
+long long duration_parse(const char* arg)
+{
+  char* end;
+  double value = strtod(arg, &end);
+  if (end == arg || value <= 0)
+    return -1;
+  if (*end == '\0' || strcmp(end, "s") == 0)
+    return value * 1e9;
+  if (strcmp(end, "ms") == 0)
+    return value * 1e6;
+  if (strcmp(end, "us") == 0)
+    return value * 1e3;
+  if (strcmp(end, "m") == 0)
+    return value * 60e9;
+  return -1;
+}
+
+void window_init(int n, long long duration_ns)
+{
+  workers = n;
+  duration = duration_ns;
+  int c = pthread_barrier_init(&start_barrier, NULL, n + 1);
+  if (c != 0) {
+    fprintf(stderr, "ERROR: pthread_barrier_init() failed: %s\n", strerror(c));
+    exit(2);
+  }
+  c = posix_memalign((void**)&progress, 64, n * sizeof(struct thread_progress));
+  if (c != 0) {
+    fprintf(stderr, "ERROR: posix_memalign() failed: %s\n", strerror(c));
+    exit(2);
+  }
+  memset(progress, 0, n * sizeof(struct thread_progress));
+}
+
+void window_destroy()
+{
+  pthread_barrier_destroy(&start_barrier);
+  free(progress);
+}
+
+// Pass the barrier.  The run starts when the first thread leaves it, which
+// need not be the main thread when there are fewer CPUs than threads; the
+// window opens when the last worker does, and the operations done by then
+// are left out of it.  Threads leave in the order they take the lock, so the
+// last to take it is the last out.
+static void window_pass(int worker)
+{
+  pthread_barrier_wait(&start_barrier);
+  pthread_mutex_lock(&window_lock);
+  uint64_t now = monotonic_ns();
+  if (run_start == 0)
+    run_start = now;
+  if (worker) {
+    window_start = now;
+    window_start_ops = progress_total();
+  }
+  pthread_mutex_unlock(&window_lock);
+}
+
+void window_wait()
+{
+  window_pass(1);
+}
+
+void window_run()
+{
+  window_pass(0);
+  if (duration == 0)
+    return;
+  uint64_t deadline = run_start + duration;
+  struct timespec ts;
+  ts.tv_sec = deadline / 1000000000;
+  ts.tv_nsec = deadline % 1000000000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+  __atomic_store_n(&window_stop, 1, __ATOMIC_RELEASE);
+  window_close();
+}
+
+long long progress_total()
+{
+  long long sum = 0;
+  for (int i = 0; i < workers; i++)
+    sum += __atomic_load_n(&progress[i].ops, __ATOMIC_RELAXED);
+  return sum;
+}
+
+void window_close()
+{
+  if (__sync_lock_test_and_set(&window_closed, 1) != 0)
+    return;
+  window_end = monotonic_ns();
+  window_ops = progress_total();
+}
+
+long long window_elapsed()
+{
+  return monotonic_ns() - run_start;
+}
+
+// With fewer CPUs than threads the first worker can finish before the last
+// one starts; the threads never all ran at once, so fall back to the whole
+// run up to the first finish
+double window_throughput()
+{
+  if (window_end <= window_start)
+    return window_end > run_start ? window_ops * 1e9 / (window_end - run_start) : 0;
+  return (window_ops - window_start_ops) * 1e9 / (window_end - window_start);
+}
+
+int work_parse(const char* arg, struct work* w)
+{
+  char* end;
+  long n = strtol(arg, &end, 10);
+  if (end == arg || n <= 0)
+    return -1;
+  memset(w, 0, sizeof(*w));
+  if (*end == '\0')
+    w->cycles = n;
+  else if (strcmp(end, "l") == 0)
+    w->lines = n;
+  else
+    return -1;
+  return 0;
+}
+
+char* work_buffer(const struct work* w)
+{
+  if (w->lines == 0)
+    return NULL;
+  char* buf;
+  int c = posix_memalign((void**)&buf, 64, w->lines * 64);
+  if (c != 0) {
+    fprintf(stderr, "ERROR: posix_memalign() failed: %s\n", strerror(c));
+    exit(2);
+  }
+  memset(buf, 0, w->lines * 64);
+  return buf;
+}
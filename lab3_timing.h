@@ -0,0 +1,145 @@
+/*
+ * Low-overhead timing for the lab3 benchmarks (--latency[=N]).  Timestamps
+ * come from the TSC, calibrated once against CLOCK_MONOTONIC (other
+ * architectures fall back to clock_gettime()).  Each thread records into its
+ * own log-linear, HDR-style histogram: values below 2^HIST_SUB_BITS ticks are
+ * exact and above that every power of two is split into 2^HIST_SUB_BITS
+ * buckets, so percentiles are within about 3%.  The histograms are merged
+ * once the threads are done.  Only every Nth operation is timed.
+ *
+ * The measurement window: workers wait on a start barrier with the main
+ * thread.  The window opens when the last worker has left the barrier and
+ * closes when the first worker finishes its iterations or, with --duration,
+ * when the duration has elapsed; the operations completed inside it give the
+ * throughput with every thread active.
+ *
+ * Synthetic work (--cs-work, --think-work): either a number of cycles, spent
+ * spinning on the TSC (a loop calibrated once drifts too much with frequency
+ * scaling and virtualization), or a number of cache lines touched ("Nl"),
+ * each incremented once.
+ */
+#ifndef LAB3_TIMING_H
+#define LAB3_TIMING_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define HIST_SUB_BITS 5
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+struct histogram {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t total;
+  uint64_t max;
+};
+
+// TSC ticks per nanosecond, set by timing_calibrate()
+extern double ticks_per_ns;
+
+// Measure the TSC rate; call once before timing anything
+void timing_calibrate();
+
+static inline uint64_t timing_now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static inline int hist_index(uint64_t value)
+{
+  if (value < (1 << HIST_SUB_BITS))
+    return value;
+  int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+  return ((shift + 1) << HIST_SUB_BITS) + (int)((value >> shift) - (1 << HIST_SUB_BITS));
+}
+
+static inline void hist_record(struct histogram* h, uint64_t ticks)
+{
+  h->counts[hist_index(ticks)]++;
+  h->total++;
+  if (ticks > h->max)
+    h->max = ticks;
+}
+
+void hist_merge(struct histogram* dst, const struct histogram* src);
+
+// Value at quantile q (0 < q <= 1), in nanoseconds
+double hist_percentile(const struct histogram* h, double q);
+
+// Append ",p50,p90,p99,p999,max" in nanoseconds to buf
+void hist_format(char* buf, const struct histogram* h);
+
+// Operations completed by one worker, padded to a cache line
+struct thread_progress {
+  volatile long long ops;
+} __attribute__((aligned(64)));
+
+extern struct thread_progress* progress;  // one per worker
+extern volatile int window_stop;  // set once --duration has elapsed
+
+// Parse a duration such as 5s, 500ms or 2m (default unit s); -1 if invalid
+long long duration_parse(const char* arg);
+
+// Set up the barrier and progress counters for n workers; duration_ns 0
+// means the workers run a fixed number of iterations
+void window_init(int n, long long duration_ns);
+void window_destroy();
+
+// Workers: wait until every worker and the main thread are ready
+void window_wait();
+
+// Main thread: release the workers and open the window; with a duration,
+// sleep through it, then stop the workers and close the window
+void window_run();
+
+// Close the window, if not yet closed; called by each worker as it finishes
+void window_close();
+
+// Nanoseconds since the window opened
+long long window_elapsed();
+
+// Operations done inside the window per second, once it is closed
+double window_throughput();
+
+// Operations done by all workers so far
+long long progress_total();
+
+struct work {
+  long cycles;  // busy cycles (TSC ticks), or 0
+  int lines;  // cache lines to touch, or 0
+};
+
+// Parse "N" (cycles) or "Nl" (cache lines) into w; -1 if invalid
+int work_parse(const char* arg, struct work* w);
+
+// A buffer for w->lines cache lines, or NULL when there are none to touch
+char* work_buffer(const struct work* w);
+
+
+static inline void work_do(const struct work* w, char* buf)
+{
+  if (w->cycles) {
+    uint64_t start = timing_now();
+    while (timing_now() - start < (uint64_t)w->cycles)
+      ;
+  }
+  for (int i = 0; i < w->lines; i++)
+    ((volatile char*)buf)[i * 64]++;
+}
+
+static inline void progress_add(struct thread_progress* p, long long n)
+{
+  __atomic_store_n(&p->ops, p->ops + n, __ATOMIC_RELAXED);
+}
+
+#endif
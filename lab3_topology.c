@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "lab3_topology.h"
+
+const char* placement_names = "compact, scatter, smt";
+
+struct cpu_info {
+  int cpu;
+  int package;
+  int core;
+  int smt;   // index among the core's SMT siblings
+  int rank;  // index of the core within its package
+  int key[4];  // sort key for the placement
+};
+
+static void topology_error(const char* message, const char* detail)
+{
+  fprintf(stderr, "ERROR: %s: %s\n", message, detail);
+  exit(1);
+}
+
+int placement_parse(const char* placement)
+{
+  if (strcmp(placement, "compact") == 0 || strcmp(placement, "scatter") == 0 ||
+      strcmp(placement, "smt") == 0)
+    return 0;
+  return -1;
+}
+
+// Read a single integer from a sysfs file; -1 if it is missing
+static int read_sysfs_int(int cpu, const char* name)
+{
+  char path[128];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+  FILE* f = fopen(path, "r");
+  if (f == NULL)
+    return -1;
+  int value;
+  if (fscanf(f, "%d", &value) != 1)
+    value = -1;
+  fclose(f);
+  return value;
+}
+
+// Parse a CPU list like "0-3,8" into set
+static void parse_cpu_list(const char* list, cpu_set_t* set)
+{
+  CPU_ZERO(set);
+  char* copy = strdup(list);
+  char* save;
+  for (char* tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+    char* end;
+    long first = strtol(tok, &end, 10), last = first;
+    if (*end == '-')
+      last = strtol(end + 1, &end, 10);
+    if (end == tok || *end != '\0' || first < 0 || last < first || last >= CPU_SETSIZE)
+      topology_error("invalid --cpus list", list);
+    for (long cpu = first; cpu <= last; cpu++)
+      CPU_SET(cpu, set);
+  }
+  free(copy);
+}
+
+static int compare_cpus(const void* a, const void* b)
+{
+  const struct cpu_info* x = a;
+  const struct cpu_info* y = b;
+  for (int i = 0; i < 4; i++) {
+    if (x->key[i] != y->key[i])
+      return x->key[i] < y->key[i] ? -1 : 1;
+  }
+  return 0;
+}
+
+void topology_plan(const char* cpus, const char* placement, int num_threads, int* plan)
+{
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+    topology_error("sched_getaffinity() failed", strerror(errno));
+  if (cpus != NULL) {
+    cpu_set_t requested;
+    parse_cpu_list(cpus, &requested);
+    CPU_AND(&allowed, &allowed, &requested);
+  }
+  int n = CPU_COUNT(&allowed);
+  if (n == 0)
+    topology_error("no usable CPUs in --cpus list", cpus != NULL ? cpus : "(all)");
+
+  struct cpu_info* info = malloc(n * sizeof(struct cpu_info));
+  if (info == NULL)
+    topology_error("malloc() failed", strerror(errno));
+  int count = 0;
+  for (int cpu = 0; cpu < CPU_SETSIZE && count < n; cpu++) {
+    if (!CPU_ISSET(cpu, &allowed))
+      continue;
+    info[count].cpu = cpu;
+    info[count].package = read_sysfs_int(cpu, "physical_package_id");
+    info[count].core = read_sysfs_int(cpu, "core_id");
+    // Without topology information every CPU is its own core
+    if (info[count].core == -1)
+      info[count].core = cpu;
+    count++;
+  }
+
+  // Number SMT siblings within each core and cores within each package
+  for (int i = 0; i < count; i++) {
+    info[i].smt = 0;
+    info[i].rank = 0;
+    for (int j = 0; j < i; j++) {
+      if (info[j].package != info[i].package)
+	continue;
+      if (info[j].core == info[i].core)
+	info[i].smt++;
+    }
+  }
+  for (int i = 0; i < count; i++) {
+    if (info[i].smt != 0)
+      continue;
+    for (int j = 0; j < i; j++) {
+      if (info[j].package == info[i].package && info[j].smt == 0 && info[j].core != info[i].core)
+	info[i].rank++;
+    }
+  }
+  for (int i = 0; i < count; i++) {
+    for (int j = 0; j < count && info[i].smt != 0; j++) {
+      if (info[j].package == info[i].package && info[j].core == info[i].core && info[j].smt == 0)
+	info[i].rank = info[j].rank;
+    }
+  }
+
+  // Order the CPUs by the placement's priorities; the CPU number breaks ties
+  if (placement == NULL)
+    placement = "compact";
+  for (int i = 0; i < count; i++) {
+    struct cpu_info* c = info + i;
+    int smt[4] = {c->package, c->rank, c->smt, c->cpu};
+    int scatter[4] = {c->smt, c->rank, c->package, c->cpu};
+    int compact[4] = {c->package, c->smt, c->rank, c->cpu};
+    if (strcmp(placement, "smt") == 0)
+      memcpy(c->key, smt, sizeof(c->key));
+    else if (strcmp(placement, "scatter") == 0)
+      memcpy(c->key, scatter, sizeof(c->key));
+    else
+      memcpy(c->key, compact, sizeof(c->key));
+  }
+  qsort(info, count, sizeof(struct cpu_info), compare_cpus);
+  for (int i = 0; i < num_threads; i++)
+    plan[i] = info[i % count].cpu;
+  free(info);
+}
+
+void topology_pin(int cpu)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  int c = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (c != 0)
+    topology_error("pthread_setaffinity_np() failed", strerror(c));
+}
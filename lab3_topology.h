@@ -0,0 +1,30 @@
+/*
+ * Thread placement for the lab3 benchmarks (--cpus, --placement).  The CPU
+ * topology (package and core of every CPU) is read from sysfs and each
+ * benchmark thread is pinned to one CPU of the plan:
+ *   compact  fill one package, one thread per physical core before using
+ *            SMT siblings
+ *   smt      fill one core's SMT siblings before moving to the next core
+ *   scatter  round-robin across packages, then cores, SMT siblings last
+ * With more threads than CPUs the plan wraps around.
+ */
+#ifndef LAB3_TOPOLOGY_H
+#define LAB3_TOPOLOGY_H
+
+// Names accepted by --placement, for usage messages
+extern const char* placement_names;
+
+// Returns 0 if placement is a valid --placement value, -1 otherwise
+int placement_parse(const char* placement);
+
+/*
+ * Fill plan[0..num_threads) with the CPU for each thread.  cpus is a --cpus
+ * list such as "0-3,8" or NULL for every CPU the process may run on;
+ * placement is a --placement value or NULL for compact.  Exits on errors.
+ */
+void topology_plan(const char* cpus, const char* placement, int num_threads, int* plan);
+
+// Pin the calling thread to cpu
+void topology_pin(int cpu);
+
+#endif
@@ -0,0 +1,202 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+
+#include "relay.h"
+
+void error_and_exit_child(const char* message, const char* error, int parentfd, int line)
+{
+  // We don't reset terminal here since fd 0 has likely been replaced already
+  write(parentfd, "\x4", 1);
+  fprintf(stderr, "ERROR: %s at line %d: %s\xD\xA", message, line, error);
+  exit(1);
+}
+
+void relay_replace_child_fds(int pipefd_to_bash[2], int pipefd_to_term[2])
+{
+  // Replace stdin with pipe from terminal process
+  if (close(0) == -1) {
+    write(pipefd_to_term[1], "\x4", 1); // This is redundant
+    error_and_exit("could not close stdin: close(0) failed", strerror(errno), __LINE__);
+  }
+  if (dup2(pipefd_to_bash[0], 0) == -1) {
+    write(pipefd_to_term[1], "\x4", 1); // This is redundant
+    fprintf(stderr, "ERROR: could not duplicate pipefd_to_bash[0]: dup2(%d,%d) "
+	    "failed at line %d: %s\xD\xA", pipefd_to_bash[0], 0, __LINE__, strerror(errno));
+    exit(1);
+  }
+  if (close(pipefd_to_bash[0]) == -1) {
+    write(pipefd_to_term[1], "\x4", 1); // This is redundant
+    fprintf(stderr, "ERROR: could not close pipefd_to_bash[0]: close(%d) "
+	    "failed at line %d: %s\xD\xA", pipefd_to_bash[0], __LINE__, strerror(errno));      
+    exit(1);
+  }
+  if (close(pipefd_to_bash[1]) == -1) {
+    // Note: switching fprintf and write causes terminal not to output properly?
+    fprintf(stderr, "ERROR: could not close pipefd_to_bash[1]: close(%d) "
+	    "failed at line %d: %s\xD\xA", pipefd_to_bash[1], __LINE__, strerror(errno));
+    write(pipefd_to_term[1], "\x4", 1); // This is redundant
+    exit(1);
+  }
+
+  // Replace stdout and stderror with pipe to terminal process
+  if (close(1) == -1) {
+    error_and_exit_child("could not close stdout: "
+			 "close(1) failed", strerror(errno), pipefd_to_term[1], __LINE__);
+  }
+    
+  if (dup2(pipefd_to_term[1], 1) == -1) {
+    int errsv = errno;
+    char msg[200];
+    sprintf(msg, "could not duplicate pipefd_to_term[1]: dup2(%d,1) failed", pipefd_to_term[1]);
+    error_and_exit_child(msg, strerror(errsv), pipefd_to_term[1], __LINE__);
+  }
+
+  // Save stderr before closing
+  int d = dup(2);
+  int errsv = errno;
+  if (d == -1) {
+    error_and_exit_child("could not duplicate stderr: "
+			 "dup(2) failed", strerror(errsv), pipefd_to_term[1], __LINE__);
+  }
+    
+  if (close(2) == -1) {
+    error_and_exit_child("could not close stderr: "
+			 "close(2) failed", strerror(errno), pipefd_to_term[1], __LINE__);
+  }
+
+  if(dup2(pipefd_to_term[1], 2) == -1) {
+    int errsv = errno;
+    dup2(d,2); // Restore stderr so that we can print error message
+    char msg[200];
+    sprintf(msg, "could not duplicate pipefd_to_term[1]: dup2(%d,2) failed", pipefd_to_term[1]);
+    error_and_exit_child(msg, strerror(errsv), pipefd_to_term[1], __LINE__);
+  }
+    
+  if(close(pipefd_to_term[0]) == -1) {
+    int errsv = errno;
+    dup2(d,2);
+    char msg[200];
+    sprintf(msg, "could not close pipefd_to_term[0]: close(%d) failed", pipefd_to_term[0]);
+    error_and_exit_child(msg, strerror(errsv), pipefd_to_term[1], __LINE__);
+  }
+    
+  if(close(pipefd_to_term[1]) == -1) {
+    int errsv = errno;
+    dup2(d,2);
+    char msg[200];
+    sprintf(msg, "could not close pipefd_to_term[1]: close(%d) failed", pipefd_to_term[1]);
+    error_and_exit_child(msg, strerror(errsv), 2, __LINE__); // Why only work properly w/ fd 1?
+  }
+}
+
+pid_t relay_start_shell(int pipefd_to_bash[2], int pipefd_to_term[2])
+{
+  // Implement pipes
+  if (pipe(pipefd_to_bash) == -1) {
+    error_and_exit("unable to initialize pipefd_to_bash: pipe() failed", strerror(errno), __LINE__);
+  }
+  if (pipe(pipefd_to_term) == -1) {
+    error_and_exit("unable to initialize pipefd_to_term: pipe() failed", strerror(errno), __LINE__);
+  }
+
+  // Fork process
+  pid_t pid = fork();
+  int errsv = errno;
+  if (pid == -1) {
+    error_and_exit("fork() failed", strerror(errsv), __LINE__);
+  }
+
+  if (pid == 0) {
+    // Replace file descriptors
+    relay_replace_child_fds(pipefd_to_bash, pipefd_to_term);
+
+    // Exec shell
+    const char* path = "/bin/bash";
+    if (execl(path, path, (char*)NULL) == -1)
+      error_and_exit_child("exec(\"/bin/bash\") failed", strerror(errno), 1, __LINE__);
+    exit(1);
+  }
+
+  // Close unused file descriptors
+  if (close(pipefd_to_bash[0]) == -1) {
+    int errsv = errno;
+    char msg[200];
+    sprintf(msg, "could not close pipefd_to_bash[0]: close(%d) failed", pipefd_to_bash[0]);
+    error_and_exit(msg, strerror(errsv), __LINE__);
+  }
+  if (close(pipefd_to_term[1]) == -1) {
+    int errsv = errno;
+    char msg[200];
+    sprintf(msg, "could not close pipefd_to_term[1]: close(%d) failed", pipefd_to_term[1]);
+    error_and_exit(msg, strerror(errsv), __LINE__);
+  }
+  return pid;
+}
+
+int relay_to_shell(const char* in, int len, char* out)
+{
+  int i;
+  for (i = 0; i < len; i++) {
+    if (in[i] == RELAY_INTR || in[i] == RELAY_EOF)
+      break;
+    out[i] = in[i] == 13 ? 10 : in[i];
+  }
+  return i;
+}
+
+int relay_to_term(const char* in, int len, char* out, bool map_cr)
+{
+  int count = 0;
+  for (int i = 0; i < len; i++) {
+    if (in[i] == 10 || (map_cr == true && in[i] == 13)) {
+      out[count++] = 13;
+      out[count++] = 10;
+    }
+    else
+      out[count++] = in[i];
+  }
+  return count;
+}
+
+void relay_write(int fd, const char* buf, int len)
+{
+  while (len > 0) {
+    int n = write(fd, buf, len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1) {
+      int errsv = errno;
+      char msg[200];
+      sprintf(msg, "could not write to file descriptor %d: write() failed", fd);
+      error_and_exit(msg, strerror(errsv), __LINE__);
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+void relay_drain(int from_shell, int fd)
+{
+  // Read remaining output until the shell's end of the pipe is gone
+  const int SIZE = 256;
+  char buf[SIZE], out[2*SIZE];
+  struct pollfd shell = {from_shell, POLLIN, 0};
+  while (1) {
+    int c = poll(&shell, 1, 0);
+    if (c < 0)
+      error_and_exit("poll() failed", strerror(errno), __LINE__);
+    else if (c == 0) // No more input left
+      return;
+    int bytes_read = read(from_shell, buf, SIZE);
+    if (bytes_read < 0)
+      error_and_exit("could not read from shell: read() failed", strerror(errno), __LINE__);
+    if (bytes_read == 0)
+      return;
+    relay_write(fd, out, relay_to_term(buf, bytes_read, out, false));
+  }
+}
@@ -0,0 +1,48 @@
+/*
+ * Relay core shared by lab1 and lab2-server: starting a shell on a pair of
+ * pipes, translating bytes between the terminal and the shell a buffer at a
+ * time, and draining what is left once the shell goes away.
+ *
+ * Build with the program that uses it, e.g.
+ *   gcc -o lab1 lab1.c relay.c
+ * The program provides error_and_exit().
+ */
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// Keyboard characters relay_to_shell() leaves to the caller
+enum {
+  RELAY_INTR = 3,  // ^C
+  RELAY_EOF = 4    // ^D
+};
+
+void error_and_exit(const char* message, const char* error, const int line);
+void error_and_exit_child(const char* message, const char* error, int parentfd, int line);
+
+// In the child: make the pipes the shell's stdin, stdout and stderr
+void relay_replace_child_fds(int pipefd_to_bash[2], int pipefd_to_term[2]);
+
+// Start /bin/bash on two new pipes; the parent keeps pipefd_to_bash[1] and
+// pipefd_to_term[0] and gets the shell's PID
+pid_t relay_start_shell(int pipefd_to_bash[2], int pipefd_to_term[2]);
+
+// Translate keyboard input for the shell (<CR> becomes <LF>) into out, up to
+// the first ^C or ^D.  Returns the number of bytes consumed, which is also the
+// number written.
+int relay_to_shell(const char* in, int len, char* out);
+
+// Translate shell output for a terminal (<LF> becomes <CR><LF>, and with
+// map_cr so does <CR>, for echoing keystrokes).  out needs room for 2*len
+// bytes; returns the number of bytes written.
+int relay_to_term(const char* in, int len, char* out, bool map_cr);
+
+// Write all of buf to fd, retrying short writes
+void relay_write(int fd, const char* buf, int len);
+
+// Copy what the shell has left in from_shell to the terminal on fd
+void relay_drain(int from_shell, int fd);
+
+#endif
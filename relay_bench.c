@@ -0,0 +1,116 @@
+#define _POSIX_C_SOURCE 200112L
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <string.h>
+
+#include "relay.h"
+
+/*
+ * Microbenchmark for the relay translation functions.  Each one is run
+ * --reps times over fixed buffers of --size bytes and the throughput is
+ * reported as one CSV line per case:
+ *   function,input,size,reps,ns_per_byte,mb_per_sec
+ * Inputs are "text" (printable lines of 80 characters), "newlines" (every
+ * byte a <LF> or <CR>, the worst case for expansion) and "keys" (short
+ * keyboard bursts ending in <CR>).
+ *
+ * Build with
+ *   gcc -O2 -o relay_bench relay_bench.c relay.c
+ */
+
+#define BILLION 1000000000LL
+
+int size = 4096;
+int reps = 100000;
+volatile int sink;  // keeps the results live
+
+void error_and_exit(const char* message, const char* error, const int line)
+{
+  fprintf(stderr, "ERROR: %s at line %d: %s\n", message, line, error);
+  exit(1);
+}
+
+void fill(char* buf, const char* input)
+{
+  for (int i = 0; i < size; i++) {
+    if (strcmp(input, "text") == 0)
+      buf[i] = i % 81 == 80 ? 10 : 'a' + i % 26;
+    else if (strcmp(input, "newlines") == 0)
+      buf[i] = i % 2 ? 10 : 13;
+    else
+      buf[i] = i % 8 == 7 ? 13 : 'a' + i % 26;
+  }
+}
+
+long long now()
+{
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+    perror("clock_gettime() failed");
+    exit(1);
+  }
+  return ts.tv_sec * BILLION + ts.tv_nsec;
+}
+
+void report(const char* function, const char* input, long long elapsed)
+{
+  double bytes = (double)size * reps;
+  printf("%s,%s,%d,%d,%.3f,%.1f\n", function, input, size, reps, elapsed / bytes,
+	 bytes / 1e6 / (elapsed / 1e9));
+}
+
+int main(int argc, char* argv[])
+{
+  static struct option long_options[] = {
+    {"size", required_argument, 0, 0},
+    {"reps", required_argument, 0, 0},
+    {0, 0, 0, 0}
+  };
+  int longindex = -1;
+  while (1) {
+    int c = getopt_long(argc, argv, "", long_options, &longindex);
+    if (c == -1)
+      break;
+    if (c == '?')
+      exit(1);
+    if (longindex == 0)
+      size = atoi(optarg);
+    else if (longindex == 1)
+      reps = atoi(optarg);
+  }
+  if (size <= 0 || reps <= 0) {
+    fprintf(stderr, "Invalid --size or --reps\n");
+    exit(1);
+  }
+
+  char* in = malloc(size);
+  char* out = malloc(2 * size);
+  if (in == NULL || out == NULL) {
+    perror("malloc() failed");
+    exit(1);
+  }
+  const char* inputs[] = {"text", "newlines", "keys"};
+  for (int k = 0; k < 3; k++) {
+    fill(in, inputs[k]);
+
+    long long start = now();
+    for (int r = 0; r < reps; r++)
+      sink += relay_to_shell(in, size, out);
+    report("relay_to_shell", inputs[k], now() - start);
+
+    start = now();
+    for (int r = 0; r < reps; r++)
+      sink += relay_to_term(in, size, out, false);
+    report("relay_to_term", inputs[k], now() - start);
+
+    start = now();
+    for (int r = 0; r < reps; r++)
+      sink += relay_to_term(in, size, out, true);
+    report("relay_to_term_cr", inputs[k], now() - start);
+  }
+  free(in);
+  free(out);
+  return 0;
+}